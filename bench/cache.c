@@ -0,0 +1,104 @@
+/*
+ * libsc - Relational memory management
+ *
+ * Copyright 2011 Nathaniel McCallum <nathaniel@themccallums.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+/*
+ * Times inserting into full caches of 1k to 60k entries, where each insert
+ * evicts the least recently used entry. The entries are touched in random
+ * order first, so the victim can sit anywhere among the cache's children.
+ */
+
+#include <libsc.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define INSERTS 4096
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double
+run_once(size_t entries)
+{
+  void *top, *cache, **items;
+  double start;
+  size_t i;
+
+  top = sc_new(NULL, char);
+  cache = sc_cache_new(top, 0, entries);
+  items = sc_newa(top, void*, entries);
+  for (i = 0; i < entries; i++)
+    items[i] = sc_new(cache, char);
+
+  /* Shuffle the LRU order away from the order of the children */
+  for (i = entries - 1; i > 0; i--) {
+    size_t j = rand() % (i + 1);
+    void *tmp = items[i];
+    items[i] = items[j];
+    items[j] = tmp;
+  }
+  for (i = 0; i < entries; i++)
+    sc_cache_touch(items[i]);
+
+  start = now();
+  for (i = 0; i < INSERTS; i++)
+    sc_new(cache, char);
+  start = now() - start;
+
+  if (sc_size_children(cache) != entries)
+    fprintf(stderr, "bad entry count\n");
+
+  sc_decref(NULL, top);
+  return start / INSERTS;
+}
+
+static double
+run(size_t entries)
+{
+  size_t rounds = 65536 / entries + 2, i;
+  double total = 0;
+
+  /* The first round only warms up the allocator */
+  for (i = 0; i < rounds; i++) {
+    double t = run_once(entries);
+    if (i > 0)
+      total += t;
+  }
+  return total / (rounds - 1);
+}
+
+int
+main(int argc, char **argv)
+{
+  static const size_t sizes[] = { 1024, 8192, 61440 };
+
+  srand(1);
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i++)
+    printf("%6zu entries: %8.0f ns per evicting insert\n",
+           sizes[i], run(sizes[i]));
+  return 0;
+}
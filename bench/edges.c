@@ -0,0 +1,119 @@
+/*
+ * libsc - Relational memory management
+ *
+ * Copyright 2011 Nathaniel McCallum <nathaniel@themccallums.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Times tagging new children, edge removal and tag counting on parents
+ * with 16, 1k and 64k children under each of the scalar, SSE2 and AVX2
+ * kernels.
+ */
+
+#include <libsc.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+static const char *tags[] = {
+  "tag0", "tag1", "tag2", "tag3", "tag4", "tag5", "tag6", "tag7"
+};
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+run(const char *mode, size_t edges)
+{
+  size_t iters = 4000000 / edges + 1000, count = 0, i;
+  void *top, *parent, *keep, **children;
+  double start, add, pop, tag;
+
+  top = sc_new(NULL, char);
+  parent = sc_new(top, char);
+  keep = sc_new(top, char);
+  children = sc_newa(top, void*, edges);
+
+  /* The common pattern: allocate a child, then tag it */
+  start = now();
+  for (i = 0; i < edges; i++) {
+    children[i] = sc_new(parent, char);
+    sc_tag_set_const(children[i], tags[i % 8]);
+  }
+  add = (now() - start) / edges;
+
+  for (i = 0; i < edges; i++)
+    sc_incref(keep, children[i]);
+
+  /* Each removal scans to a random child, then it is appended again */
+  srand(1);
+  start = now();
+  for (i = 0; i < iters; i++) {
+    void *chld = children[rand() % edges];
+    sc_decref(parent, chld);
+    sc_incref(parent, chld);
+  }
+  pop = (now() - start) / iters;
+
+  start = now();
+  for (i = 0; i < iters; i++)
+    count += sc_size_children_tag(parent, tags[i % 8]);
+  tag = (now() - start) / iters;
+
+  if (count != iters * edges / 8 && edges % 8 == 0)
+    fprintf(stderr, "bad tag count\n");
+
+  printf("%-6s %6zu edges: new+tag %7.1f ns, pop %9.1f ns, "
+         "tag count %9.1f ns\n", mode, edges, add, pop, tag);
+  sc_decref(NULL, top);
+}
+
+int
+main(int argc, char **argv)
+{
+  static const char *modes[] = { "scalar", "sse2", "avx2" };
+  const char *mode = getenv("LIBSC_SIMD");
+
+  /* Kernels are picked at load time, so each mode needs a new process */
+  if (!mode) {
+    for (size_t i = 0; i < sizeof(modes) / sizeof(*modes); i++) {
+      pid_t pid = fork();
+      if (pid == 0) {
+        setenv("LIBSC_SIMD", modes[i], 1);
+        execv(argv[0], argv);
+        _exit(1);
+      }
+      waitpid(pid, NULL, 0);
+    }
+    return 0;
+  }
+
+  run(mode, 16);
+  run(mode, 1024);
+  run(mode, 65528);
+  fflush(stdout);
+  return 0;
+}
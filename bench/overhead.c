@@ -0,0 +1,78 @@
+/*
+ * libsc - Relational memory management
+ *
+ * Copyright 2011 Nathaniel McCallum <nathaniel@themccallums.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Measures the heap bytes used per aligned allocation beyond its payload,
+ * against plain posix_memalign().
+ */
+
+#include <libsc.h>
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define COUNT 1024
+
+static size_t
+used(void)
+{
+  struct mallinfo2 mi = mallinfo2();
+  return mi.uordblks + mi.hblkhd;
+}
+
+static void
+run(size_t align, size_t size)
+{
+  static void *ptrs[COUNT];
+  size_t before, raw, sc;
+  void *top;
+
+  before = used();
+  for (size_t i = 0; i < COUNT; i++)
+    if (posix_memalign(&ptrs[i], align, size) != 0)
+      abort();
+  raw = (used() - before) / COUNT - size;
+  for (size_t i = 0; i < COUNT; i++)
+    free(ptrs[i]);
+
+  top = sc_new(NULL, char);
+  before = used();
+  for (size_t i = 0; i < COUNT; i++)
+    if (!sc_memalign(top, align, size, NULL))
+      abort();
+  sc = (used() - before) / COUNT - size;
+  sc_decref(NULL, top);
+
+  printf("align %5zu, size %5zu: posix_memalign %5zu, libsc %5zu bytes\n",
+         align, size, raw, sc);
+}
+
+int
+main(int argc, char **argv)
+{
+  run(64, 64);
+  run(64, 4096);
+  run(256, 256);
+  run(4096, 512);
+  run(4096, 4096);
+  run(4096, 65536);
+  return 0;
+}
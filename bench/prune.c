@@ -0,0 +1,95 @@
+/*
+ * libsc - Relational memory management
+ *
+ * Copyright 2011 Nathaniel McCallum <nathaniel@themccallums.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Times dropping every other child of parents with 1k to 64k children, one
+ * sc_decref() at a time and with a single sc_decref_many().
+ */
+
+#include <libsc.h>
+
+#include <stdio.h>
+#include <time.h>
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double
+run_once(size_t edges, bool batched)
+{
+  void *top, *parent, **children;
+  double start;
+  size_t i;
+
+  top = sc_new(NULL, char);
+  parent = sc_new(top, char);
+  children = sc_newa(top, void*, edges / 2);
+  for (i = 0; i < edges; i++) {
+    void *chld = sc_new(parent, char);
+    if (i % 2 == 0)
+      children[i / 2] = chld;
+  }
+
+  start = now();
+  if (batched) {
+    sc_decref_many(parent, children, edges / 2);
+  } else {
+    for (i = 0; i < edges / 2; i++)
+      sc_decref(parent, children[i]);
+  }
+  start = now() - start;
+
+  if (sc_size_children(parent) != edges - edges / 2)
+    fprintf(stderr, "bad child count\n");
+
+  sc_decref(NULL, top);
+  return start;
+}
+
+static double
+run(size_t edges, bool batched)
+{
+  size_t rounds = 65536 / edges + 2, i;
+  double total = 0;
+
+  /* The first round only warms up the allocator */
+  for (i = 0; i < rounds; i++) {
+    double t = run_once(edges, batched);
+    if (i > 0)
+      total += t;
+  }
+  return total / (rounds - 1);
+}
+
+int
+main(int argc, char **argv)
+{
+  static const size_t sizes[] = { 1024, 8192, 65528 };
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i++)
+    printf("%6zu edges: one by one %12.0f ns, batched %10.0f ns\n",
+           sizes[i], run(sizes[i], false), run(sizes[i], true));
+  return 0;
+}
@@ -0,0 +1,111 @@
+/*
+ * libsc - Relational memory management
+ *
+ * Copyright 2011 Nathaniel McCallum <nathaniel@themccallums.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Times tearing down a tree of about 300k chunks with sc_decref() and
+ * with sc_decref_parallel() on 2 to 8 threads. Destructors either do
+ * nothing, spin briefly, or (for one chunk in 256) block as if closing a
+ * file. Blocking destructors overlap even on a single CPU.
+ */
+
+#include <libsc.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define FANOUT 8
+#define DEPTH  6
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+spin(void *mem)
+{
+  volatile unsigned x = 0;
+
+  for (int i = 0; i < 200; i++)
+    x += i;
+}
+
+static void
+block(void *mem)
+{
+  struct timespec ts = { 0, 50000 };
+
+  if (((size_t) *(char*) mem) % 256 == 0)
+    nanosleep(&ts, NULL);
+}
+
+static void
+build(void *parent, int depth, scFree *destructor, size_t *count)
+{
+  for (int i = 0; i < FANOUT; i++) {
+    char *chld = sc_new(parent, char);
+
+    *chld = (char) (*count)++;
+    sc_destructor_set(chld, destructor);
+    if (depth > 1)
+      build(chld, depth - 1, destructor, count);
+  }
+}
+
+static double
+run(scFree *destructor, size_t threads, size_t *count)
+{
+  void *top = sc_new(NULL, char);
+  double start;
+
+  *count = 0;
+  build(top, DEPTH, destructor, count);
+
+  start = now();
+  if (threads == 1)
+    sc_decref(NULL, top);
+  else
+    sc_decref_parallel(NULL, top, threads);
+  return (now() - start) / 1e6;
+}
+
+int
+main(int argc, char **argv)
+{
+  static const struct {
+    const char *name;
+    scFree *destructor;
+  } modes[] = { { "none", NULL }, { "spin", spin }, { "block", block } };
+  static const size_t threads[] = { 1, 2, 4, 8 };
+  size_t count;
+
+  for (size_t i = 0; i < sizeof(modes) / sizeof(*modes); i++) {
+    printf("%-5s", modes[i].name);
+    for (size_t j = 0; j < sizeof(threads) / sizeof(*threads); j++)
+      printf("  %zu thr %8.1f ms", threads[j],
+             run(modes[i].destructor, threads[j], &count));
+    printf("  (%zu chunks)\n", count);
+  }
+  return 0;
+}
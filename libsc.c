@@ -24,6 +24,24 @@
 #include <string.h>
 #include <stdio.h>
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* <unistd.h> declares link() and unlink(), which clash with our internals */
+#define link   posix_link
+#define unlink posix_unlink
+#include <unistd.h>
+#undef link
+#undef unlink
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define SIMD_X86 1
+#endif
+
 #ifndef UINT16_MAX
 #define UINT16_MAX 65535
 #endif
@@ -31,499 +49,3450 @@
 #define DEFAULT_LINK_SIZE 2
 
 #define SC_FLAGS_TAG_ALLOCATED (1 << 0)
+#define SC_FLAGS_ACCOUNT       (1 << 1)
+#define SC_FLAGS_CACHE         (1 << 2)
+#define SC_FLAGS_WEAK          (1 << 3)
+#define SC_FLAGS_WEAK_HANDLE   (1 << 4)
+#define SC_FLAGS_MAPPED        (1 << 5)
+#define SC_FLAGS_SLAB          (1 << 6)
+#define SC_FLAGS_SLICE         (1 << 7)
+#define SC_FLAGS_INTERN        (1 << 8)
+#define SC_FLAGS_OUTLINE       (1 << 9)
+#define SC_FLAGS_BACKEND       (1 << 10)
+
+#define IMAGE_MAGIC   "libscimg"
+#define IMAGE_VERSION 1
+#define IMAGE_ALIGN   16
+#define SHM_MAGIC     "libscshm"
 
-#define _GET_CHUNK(mem) \
-  (mem >= sizeof(chunk) ? (mem - sizeof(chunk)) : 0)
 #define GET_CHUNK(mem) \
-  ((chunk*) _GET_CHUNK((uintptr_t) (mem)))
+  get_chunk(mem)
 #define GET_ALLOC(chnk) \
-  ((void*) (chnk ? chnk + 1 : NULL))
+  ((void*) (chnk ? PAYLOAD(chnk) : NULL))
+#define PAYLOAD(chnk) \
+  ((chnk)->flags & SC_FLAGS_OUTLINE ? (chnk)->base : (void*) ((chnk) + 1))
 #define OR_MAX(n) \
   (n < UINT16_MAX ? n : UINT16_MAX)
+#define IS_MAPPED(chnk) \
+  (chnk && (chnk)->flags & SC_FLAGS_MAPPED)
+#define ALIGN_UP(n, a) \
+  (((n) + (a) - 1) & ~((size_t) (a) - 1))
+#define RELATIVE(chnk, off) \
+  ((void*) (((char*) (chnk)) + (intptr_t) (off)))
+
+/* Each edge array is followed by the tag ids of the chunks it refers to */
+#define LINK_IDS(lnk) \
+  ((uint32_t*) ((lnk)->chunks + (lnk)->size))
+#define LINK_BYTES(n) \
+  ((n) * sizeof(chunk*) + ALIGN_UP((n) * sizeof(uint32_t), sizeof(chunk*)))
+
+/* Below this many edges a scan isn't worth a call into a vector kernel */
+#define FIND_MIN 8
+
+/* Allocations aligned to at least this keep their header out of line */
+#define OUTLINE_ALIGN 256
+
+/* The outline map covers 48-bit addresses, ten bits per level */
+#define OUTLINE_BITS   10
+#define OUTLINE_LEVELS 4
+#define OUTLINE_FANOUT (1 << OUTLINE_BITS)
+
+/* Room before the header of a chunk from a backend, to point back at it */
+#define BACKEND_PREFIX 16
 
 typedef struct chunk chunk;
 typedef struct link  link;
+typedef struct ext   ext;
+typedef struct cache cache;
+typedef struct weak  weak;
+typedef struct slice slice;
+typedef struct image image;
+typedef struct ptrmap ptrmap;
+typedef struct reloc reloc;
 
 struct link {
   chunk  **chunks;
   uint16_t size;
   uint16_t used;
+  bool     borrowed;  /* The array lives in a clone's slab */
 };
 
-struct chunk {
-  void   *base;
-  link    parents;
-  link    children;
-  chunk  *prev;
-  chunk  *next;
+/* Optional per-chunk state, allocated on first use */
+struct ext {
+  chunk    *owner;   /* The parent this subtree is charged to */
+  size_t    bytes;   /* Retained bytes of the owned subtree */
+  size_t    count;   /* Retained chunks of the owned subtree */
+  size_t    limit;   /* Byte budget, zero if unlimited */
+  scBudget *budget;
+  void     *misc;
+  chunk    *cache;   /* The cache context tracking this chunk */
+  chunk    *newer;
+  chunk    *older;
+  uint16_t  slot;    /* Index of this chunk in its cache's children */
+  weak     *weak;    /* Weak handles pointing at this chunk */
+};
+
+/* The payload of a cache context */
+struct cache {
+  chunk *newest;
+  chunk *oldest;
+  size_t bytes;
+  size_t entries;
+  scCacheStats stats;
+};
+
+/* The payload of a weak handle */
+struct weak {
+  chunk *target;
+  weak  *prev;
+  weak  *next;
+};
+
+/* The payload of a slice; source is also a child of the slice */
+struct slice {
+  scSlice view;
+  char   *source;
+};
+
+/*
+ * A snapshot image is a header followed by chunks (each immediately followed
+ * by its payload), their edge arrays and their tags. Mapped chunks store
+ * every reference as an offset from the chunk itself, so the image can be
+ * used at any address without being modified.
+ */
+struct image {
+  char     magic[8];
+  uint32_t version;
+  uint32_t header;    /* sizeof(chunk) of the writer */
+  uint64_t size;      /* Total bytes in the image */
+  uint64_t root;      /* Offset of the root chunk */
+  uint64_t count;     /* Number of chunks */
+};
+
+/* Maps chunks to indices, used when copying a subtree */
+struct ptrmap {
+  chunk **keys;
+  size_t *vals;
   size_t  size;
-  char   *tag;
-  scFree *destructor;
-  uint8_t flags;
+  size_t  used;
 };
 
-static bool
-push(link* lnk, chunk *chnk)
+struct reloc {
+  ptrmap  map;
+  chunk **order;
+  size_t  count;
+  size_t *offsets;
+  chunk **copies;   /* Only when cloning */
+};
+
+/* The head of a clone's bulk allocation, shared by all of its chunks */
+typedef struct {
+  size_t live;
+  size_t size;
+  const scAllocator *backend;
+} slab;
+
+struct chunk {
+  void    *base;
+  link     parents;
+  link     children;
+  chunk   *prev;
+  chunk   *next;
+  size_t   size;
+  char    *tag;
+  scFree  *destructor;
+  ext     *ext;
+  uint16_t flags;
+  uint8_t  align;     /* log2 of the alignment asked of _memalign() */
+  uint32_t tagid;     /* Hash of the tag, zero if there is none */
+};
+
+typedef struct {
+  size_t (*find)(chunk **chunks, size_t used, chunk *chnk);
+  size_t (*count)(chunk **chunks, const uint32_t *ids, size_t used,
+                  uint32_t id, const char *tag);
+} kernels;
+
+static uint32_t
+tag_hash(const char *tag)
 {
-  if (!lnk)
-    return false;
+  uint32_t h = 0x811c9dc5;
 
-  if (lnk->used == lnk->size) {
-    size_t size = lnk->size > 0
-                    ? OR_MAX(((size_t) lnk->size) * 2)
-                    : DEFAULT_LINK_SIZE;
-    /* Check to make sure we don't roll over our ref */
-    if (size == lnk->size)
-      return false;
-    chunk **tmp = (chunk**) realloc(lnk->chunks, size * sizeof(chunk*));
-    if (!tmp)
-      return false;
-    lnk->chunks = tmp;
-    lnk->size = size;
-  }
+  if (!tag)
+    return 0;
 
-  lnk->chunks[lnk->used++] = chnk;
-  return true;
+  while (*tag)
+    h = (h ^ (unsigned char) *tag++) * 0x01000193;
+
+  return h ? h : 1;
 }
 
 static bool
-pop(link *lnk, chunk *chnk)
+tag_is(chunk *chnk, const char *tag)
+{
+  return chnk->tag == tag || (chnk->tag && !strcmp(chnk->tag, tag));
+}
+
+static size_t
+find_scalar(chunk **chunks, size_t used, chunk *chnk)
 {
   size_t i;
-  if (!lnk || !lnk->chunks)
-    return false;
 
-  for (i = 0; i < lnk->used; i++) {
-    if (lnk->chunks[i] == chnk) {
-      lnk->chunks[i] = lnk->chunks[--lnk->used];
-      return true;
-    }
-  }
+  for (i = 0; i < used && chunks[i] != chnk; i++)
+    continue;
 
-  return false;
+  return i;
 }
 
-#define sib_loop(chnk, tmp, code) \
-  for (chunk *step_, *tmp = chnk->prev; tmp; tmp = step_) { \
-    step_ = tmp->prev; \
-    code; \
-  } \
-  for (chunk *step_, *tmp = chnk; tmp; tmp = step_) { \
-    step_ = tmp->next; \
-    code; \
-  }
+static size_t
+count_scalar(chunk **chunks, const uint32_t *ids, size_t used,
+             uint32_t id, const char *tag)
+{
+  size_t i, count = 0;
 
-static void
-unlink(chunk *prnt, chunk *chld, bool bothsides)
+  for (i = 0; i < used; i++)
+    if (ids[i] == id && tag_is(chunks[i], tag))
+      count++;
+
+  return count;
+}
+
+#ifdef SIMD_X86
+__attribute__((target("sse2")))
+static size_t
+find_sse2(chunk **chunks, size_t used, chunk *chnk)
 {
-  if (!chld)
-    return;
+  __m128i key = _mm_set1_epi64x((int64_t) (uintptr_t) chnk);
+  size_t i;
 
-  if (pop(&chld->parents, prnt) && prnt && bothsides)
-    pop(&prnt->children, chld);
+  for (i = 0; i + 4 <= used; i += 4) {
+    __m128i a = _mm_loadu_si128((const __m128i*) (chunks + i));
+    __m128i b = _mm_loadu_si128((const __m128i*) (chunks + i + 2));
 
-  size_t count = 0;
-  sib_loop(chld, tmp, count += tmp->parents.used);
-  if (count == 0) {
-    /* First loop: call all destructors */
-    sib_loop(chld, tmp,
-      if (tmp->destructor)
-        tmp->destructor(GET_ALLOC(tmp));
-    );
+    /* No 64-bit compare in SSE2: both halves of a pointer must match */
+    a = _mm_cmpeq_epi32(a, key);
+    b = _mm_cmpeq_epi32(b, key);
+    a = _mm_and_si128(a, _mm_shuffle_epi32(a, _MM_SHUFFLE(2, 3, 0, 1)));
+    b = _mm_and_si128(b, _mm_shuffle_epi32(b, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    int mask = _mm_movemask_pd(_mm_castsi128_pd(a))
+             | _mm_movemask_pd(_mm_castsi128_pd(b)) << 2;
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+
+  return i + find_scalar(chunks + i, used - i, chnk);
+}
+
+__attribute__((target("sse2")))
+static size_t
+count_sse2(chunk **chunks, const uint32_t *ids, size_t used,
+           uint32_t id, const char *tag)
+{
+  __m128i key = _mm_set1_epi32((int) id);
+  size_t i, count = 0;
 
-    /* Second loop: remove the children, do the free */
-    sib_loop(chld, tmp,
-      for (size_t i=tmp->children.used; i > 0; i--)
-        unlink(tmp, tmp->children.chunks[i-1], false);
+  for (i = 0; i + 4 <= used; i += 4) {
+    __m128i a = _mm_loadu_si128((const __m128i*) (ids + i));
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(a, key)));
 
-      free(tmp->children.chunks);
-      free(tmp->parents.chunks);
-      free(tmp->base);
-    );
+    for (; mask; mask &= mask - 1)
+      count += tag_is(chunks[i + __builtin_ctz(mask)], tag);
   }
+
+  return count + count_scalar(chunks + i, ids + i, used - i, id, tag);
 }
 
-static chunk *
-_malloc(size_t size)
+__attribute__((target("avx2")))
+static size_t
+find_avx2(chunk **chunks, size_t used, chunk *chnk)
 {
-  void *tmp;
+  __m256i key = _mm256_set1_epi64x((int64_t) (uintptr_t) chnk);
+  size_t i;
 
-  tmp = malloc(sizeof(chunk) + size);
-  if (!tmp)
-    return NULL;
+  for (i = 0; i + 8 <= used; i += 8) {
+    __m256i a = _mm256_loadu_si256((const __m256i*) (chunks + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*) (chunks + i + 4));
+
+    int mask = _mm256_movemask_pd(_mm256_castsi256_pd(
+                                  _mm256_cmpeq_epi64(a, key)))
+             | _mm256_movemask_pd(_mm256_castsi256_pd(
+                                  _mm256_cmpeq_epi64(b, key))) << 4;
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
 
-  memset(tmp, 0, sizeof(chunk));
-  ((chunk*) tmp)->base = tmp;
-  return (chunk*) tmp;
+  return i + find_scalar(chunks + i, used - i, chnk);
 }
 
-static chunk *
-_memalign(size_t size, size_t align)
+__attribute__((target("avx2")))
+static size_t
+count_avx2(chunk **chunks, const uint32_t *ids, size_t used,
+           uint32_t id, const char *tag)
 {
-  chunk *chnk = NULL;
-  size_t header = 0;
-  int err = 0;
-  void *tmp;
+  __m256i key = _mm256_set1_epi32((int) id);
+  size_t i, count = 0;
 
-  while (header < sizeof(chunk))
-    header += align;
+  for (i = 0; i + 8 <= used; i += 8) {
+    __m256i a = _mm256_loadu_si256((const __m256i*) (ids + i));
+    int mask = _mm256_movemask_ps(_mm256_castsi256_ps(
+                                  _mm256_cmpeq_epi32(a, key)));
 
-  err = posix_memalign(&tmp, align, header + size);
-  if (err != 0) {
-    errno = err;
-    return NULL;
+    for (; mask; mask &= mask - 1)
+      count += tag_is(chunks[i + __builtin_ctz(mask)], tag);
   }
 
-  /* Chunk data goes at the end of the header */
-  chnk = (chunk*) (((uintptr_t) tmp) + header - sizeof(chunk));
-  memset(chnk, 0, sizeof(chunk));
-  chnk->base = tmp;
-  return chnk;
+  return count + count_scalar(chunks + i, ids + i, used - i, id, tag);
 }
+#endif
 
-void *
-_sc_alloc(void *parent, size_t size, size_t count, size_t align,
-           const char *tag, const char *location)
+static kernels simd = { find_scalar, count_scalar };
+
+/* Picks the widest kernels the CPU supports; LIBSC_SIMD can force others */
+__attribute__((constructor))
+static void
+simd_init(void)
 {
-  chunk *chnk = NULL;
-  void *tmp;
+#ifdef SIMD_X86
+  const char *force = getenv("LIBSC_SIMD");
 
-  if (align == 0)
-    chnk = _malloc(size * count);
-  else
-    chnk = _memalign(size * count, align);
-  if (!chnk)
-    return NULL;
+  __builtin_cpu_init();
+  if (force && !strcmp(force, "scalar"))
+    return;
 
-  chnk->size = size * count;
-  chnk->tag = (char*) tag;
-  tmp = sc_incref(parent, GET_ALLOC(chnk));
+  if (__builtin_cpu_supports("avx2") && !(force && !strcmp(force, "sse2"))) {
+    simd.find = find_avx2;
+    simd.count = count_avx2;
+  } else {
+    simd.find = find_sse2;
+    simd.count = count_sse2;
+  }
+#endif
+}
 
-  if (!tmp)
-    free(chnk->base);
-  return tmp;
+static inline size_t
+find(chunk **chunks, size_t used, chunk *chnk)
+{
+  if (used >= FIND_MIN)
+    return simd.find(chunks, used, chnk);
+  return find_scalar(chunks, used, chnk);
 }
 
-void *
-_sc_alloc0(void *parent, size_t size, size_t count, size_t align,
-            const char *tag, const char *location)
+/*
+ * Chunks allocated from a backend point at it from just before their
+ * header, or from their slab. Everything else uses the C library directly.
+ */
+static const scAllocator *
+backend(chunk *chnk)
 {
-  void *tmp = _sc_alloc(parent, size, count, align, tag, location);
-  if (tmp)
-    memset(tmp, 0, size * count);
-  return tmp;
+  if (!chnk || !(chnk->flags & SC_FLAGS_BACKEND))
+    return NULL;
+
+  if (chnk->flags & SC_FLAGS_SLAB)
+    return ((slab*) chnk->base)->backend;
+
+  return ((const scAllocator**) chnk)[-1];
 }
 
-bool
-_sc_resizea(void **mem, size_t size, size_t count, size_t align)
+static void *
+mem_alloc(const scAllocator *be, size_t size)
 {
-  chunk *chnk, *tmp;
-  size_t i, j;
+  if (!be)
+    return malloc(size);
+  return be->alloc(be->ctx, size);
+}
 
-  chnk = GET_CHUNK(mem ? *mem : NULL);
-  if (!chnk)
-    return false;
+static int
+mem_memalign(const scAllocator *be, void **ptr, size_t align, size_t size)
+{
+  if (!be)
+    return posix_memalign(ptr, align, size);
 
-  if (align == 0) {
-    tmp = (chunk*) realloc(chnk, sizeof(chunk) + (size * count));
-    if (!tmp)
-      return false;
+  if (!be->memalign)
+    return EINVAL;
 
-    tmp->base = tmp;
-  } else {
-    void *tmpbase;
+  *ptr = be->memalign(be->ctx, align, size);
+  return *ptr ? 0 : ENOMEM;
+}
 
-    tmp = _memalign(size * count, align);
-    if (!tmp)
-      return false;
+static void
+mem_free(const scAllocator *be, void *ptr, size_t size)
+{
+  if (!be)
+    free(ptr);
+  else if (ptr)
+    be->free(be->ctx, ptr, size);
+}
 
-    tmpbase = tmp->base;
-    memcpy(tmp, chnk, chnk->size + sizeof(chunk));
-    tmp->base = tmpbase;
-    free(chnk->base);
-  }
+static void *
+mem_realloc(const scAllocator *be, void *ptr, size_t old, size_t size)
+{
+  void *tmp;
 
-  /* If the memory was reallocated, we have to update references */
-  if (tmp != chnk) {
-    /* Update parents */
-    for (i = 0; i < tmp->parents.used; i++)
-      for (j = 0; j < tmp->parents.chunks[i]->children.used; j++)
-        if (tmp->parents.chunks[i]->children.chunks[j] == chnk)
-          tmp->parents.chunks[i]->children.chunks[j] = tmp;
+  if (!be)
+    return realloc(ptr, size);
 
-    /* Update children */
-    for (i = 0; i < tmp->children.used; i++)
-      for (j = 0; j < tmp->children.chunks[i]->parents.used; j++)
-        if (tmp->children.chunks[i]->parents.chunks[j] == chnk)
-          tmp->children.chunks[i]->parents.chunks[j] = tmp;
+  if (be->realloc)
+    return be->realloc(be->ctx, ptr, old, size);
 
-    /* Update cousins */
-    if (tmp->next)
-      tmp->next->prev = tmp;
-    if (tmp->prev)
-      tmp->prev->next = tmp;
+  tmp = be->alloc(be->ctx, size);
+  if (tmp) {
+    memcpy(tmp, ptr, old < size ? old : size);
+    be->free(be->ctx, ptr, old);
   }
-
-  tmp->size = size * count;
-  *mem = GET_ALLOC(tmp);
-  return true;
+  return tmp;
 }
 
-bool
-_sc_resizea0(void **mem, size_t size, size_t count, size_t align)
+/* Edge arrays come from the backend of the chunk that holds them */
+static bool
+grow(chunk *chnk, link *lnk, size_t size)
 {
-  chunk *chnk = GET_CHUNK(mem ? *mem : NULL);
-  if (!chnk)
-    return false;
-  size_t oldsize = chnk->size;
-
-  if (!_sc_resizea(mem, size, count, align))
-    return false;
+  const scAllocator *be = backend(chnk);
+  chunk **tmp;
+
+  /* Arrays borrowed from a slab can't be reallocated */
+  if (lnk->borrowed || !lnk->chunks) {
+    tmp = (chunk**) mem_alloc(be, LINK_BYTES(size));
+    if (tmp && lnk->chunks) {
+      memcpy(tmp, lnk->chunks, lnk->used * sizeof(chunk*));
+      memcpy(tmp + size, LINK_IDS(lnk), lnk->used * sizeof(uint32_t));
+    }
+  } else {
+    tmp = (chunk**) mem_realloc(be, lnk->chunks, LINK_BYTES(lnk->size),
+                                LINK_BYTES(size));
+    if (tmp)
+      memmove(tmp + size, tmp + lnk->size, lnk->used * sizeof(uint32_t));
+  }
 
-  chnk = GET_CHUNK(mem ? *mem : NULL);
-  if (!chnk)
+  if (!tmp)
     return false;
-  if (size * count > oldsize)
-    memset(((char *) *mem) + oldsize, 0, size * count - oldsize);
+  lnk->chunks = tmp;
+  lnk->size = size;
+  lnk->borrowed = false;
   return true;
 }
 
-void *
-_sc_incref(void *parent, void *child, const char *location)
+static bool
+own(chunk *chnk, link *lnk)
 {
-  chunk *chld, *prnt;
-
-  chld = GET_CHUNK(child);
-  prnt = GET_CHUNK(parent);
-  if (!chld)
-    return NULL;
-
-  if (!push(&(chld->parents), prnt))
-    return NULL;
-
-  if (prnt && !push(&(prnt->children), chld)) {
-    pop(&(chld->parents), prnt);
-    return NULL;
+  if (!lnk->borrowed)
+    return true;
+
+  if (lnk->used == 0) {
+    lnk->chunks = NULL;
+    lnk->size = 0;
+    lnk->borrowed = false;
+    return true;
   }
 
-  return child;
+  return grow(chnk, lnk, lnk->used);
 }
 
-void
-_sc_decref(void *parent, void *child, const char *location)
+static void
+link_free(chunk *chnk, link *lnk)
 {
-  unlink(GET_CHUNK(parent), GET_CHUNK(child), true);
+  if (!lnk->borrowed)
+    mem_free(backend(chnk), lnk->chunks, LINK_BYTES(lnk->size));
 }
 
-void *
-_sc_steal(void *parent, void *child, void *pold, const char *location)
+static bool
+push(chunk *owner, link* lnk, chunk *chnk)
 {
-  chunk *chld = GET_CHUNK(child);
-  chunk *prnt = GET_CHUNK(pold);
-  int i;
-
-  if (!chld || (pold && !prnt) || (!pold && chld->parents.used != 1))
-    return NULL;
-
-  if (!pold)
-    prnt = chld->parents.chunks[0];
+  if (!lnk)
+    return false;
 
-  for (i = 0; i < chld->parents.used; i++) {
-    if (chld->parents.chunks[i] == prnt) {
-      if (prnt)
-        pop(&prnt->children, chld);
-      pop(&chld->parents, chld->parents.chunks[i]);
-      return _sc_incref(parent, child, location);
-    }
+  if (lnk->used >= lnk->size) {
+    size_t size = lnk->used > 0
+                    ? OR_MAX(((size_t) lnk->used) * 2)
+                    : DEFAULT_LINK_SIZE;
+    /* Check to make sure we don't roll over our ref */
+    if (size == lnk->used || !grow(owner, lnk, size))
+      return false;
   }
 
-  return NULL;
+  LINK_IDS(lnk)[lnk->used] = chnk ? chnk->tagid : 0;
+  lnk->chunks[lnk->used++] = chnk;
+  return true;
 }
 
-void
-_sc_destructor_set(void *mem, scFree *destructor)
+/* Whether lnk holds the entries of the cache tracking chnk */
+static inline bool
+cached_in(link *lnk, chunk *chnk)
 {
-  chunk *chnk = GET_CHUNK(mem);
-  if (chnk)
-    chnk->destructor = destructor;
+  return chnk && chnk->ext && chnk->ext->cache
+              && lnk == &chnk->ext->cache->children;
 }
 
-void *
-sc_ensure_tag(void *mem, const char *tag)
+/* Moves the edge in slot from to slot to, keeping cache slots current */
+static inline void
+move(link *lnk, size_t from, size_t to)
 {
-  const char *t = sc_tag_get(mem);
+  lnk->chunks[to] = lnk->chunks[from];
+  LINK_IDS(lnk)[to] = LINK_IDS(lnk)[from];
+  if (cached_in(lnk, lnk->chunks[to]))
+    lnk->chunks[to]->ext->slot = to;
+}
 
-  if (!t || !tag || strcmp(t, tag))
-    return NULL;
+static bool
+pop(link *lnk, chunk *chnk)
+{
+  size_t i;
+  if (!lnk || !lnk->chunks)
+    return false;
 
-  return mem;
+  /*
+   * Cache entries know their slot, so eviction doesn't search. The cache
+   * is forgotten by pop_parent() before the child edge goes, so only the
+   * slot itself is checked.
+   */
+  if (chnk && chnk->ext && chnk->ext->slot < lnk->used
+           && lnk->chunks[chnk->ext->slot] == chnk)
+    i = chnk->ext->slot;
+  else
+    i = find(lnk->chunks, lnk->used, chnk);
+  if (i == lnk->used)
+    return false;
+
+  move(lnk, --lnk->used, i);
+  return true;
 }
 
-void
-sc_group(void *cousin, void *mem)
+/* Points every edge to from at to instead */
+static void
+relink(link *lnk, chunk *from, chunk *to)
 {
-  chunk *chnk = GET_CHUNK(mem);
-  chunk *csnc = GET_CHUNK(cousin);
-  if (!chnk || !csnc)
+  size_t i = 0;
+
+  while ((i += find(lnk->chunks + i, lnk->used - i, from)) < lnk->used)
+    lnk->chunks[i++] = to;
+}
+
+/*
+ * Gives one edge to chnk in lnk the id it doesn't have yet. A new child
+ * is usually the last one, so that slot is checked before searching.
+ */
+static void
+retag_edge(link *lnk, chunk *chnk, uint32_t id)
+{
+  size_t i = lnk->used - 1;
+
+  if (lnk->used > 0 && lnk->chunks[i] == chnk && LINK_IDS(lnk)[i] != id) {
+    LINK_IDS(lnk)[i] = id;
     return;
+  }
 
-  chunk *head = chnk;
-  chunk *tail = chnk;
-  while (head->prev)
-    head = head->prev;
-  while (tail->next)
-    tail = tail->next;
+  for (i = 0; (i += find(lnk->chunks + i, lnk->used - i, chnk)) < lnk->used;
+       i++) {
+    if (LINK_IDS(lnk)[i] != id) {
+      LINK_IDS(lnk)[i] = id;
+      return;
+    }
+  }
+}
+
+/* Updates the tag ids stored in the edge arrays of chnk's neighbors */
+static void
+retag(chunk *chnk, const char *tag)
+{
+  uint32_t id = tag_hash(tag);
+  size_t i;
+
+  chnk->tag = (char*) tag;
+  if (id == chnk->tagid)
+    return;
+  chnk->tagid = id;
+
+  /* Each edge of chnk has a mirror entry in its neighbor's array */
+  for (i = 0; i < chnk->parents.used; i++)
+    if (chnk->parents.chunks[i])
+      retag_edge(&chnk->parents.chunks[i]->children, chnk, id);
+
+  for (i = 0; i < chnk->children.used; i++)
+    retag_edge(&chnk->children.chunks[i]->parents, chnk, id);
+}
+
+static chunk *
+link_get(chunk *chnk, link *lnk, size_t i)
+{
+  if (chnk->flags & SC_FLAGS_MAPPED)
+    return RELATIVE(chnk, ((int64_t*) RELATIVE(chnk, lnk->chunks))[i]);
+  return lnk->chunks[i];
+}
+
+static const char *
+tag_get(chunk *chnk)
+{
+  if (chnk->flags & SC_FLAGS_MAPPED)
+    return chnk->tag ? RELATIVE(chnk, chnk->tag) : NULL;
+  return chnk->tag;
+}
+
+static size_t
+ptrmap_hash(chunk *key)
+{
+  uint64_t h = ((uint64_t) (uintptr_t) key) * 0x9e3779b97f4a7c15ull;
+  return (size_t) (h ^ (h >> 32));
+}
+
+static size_t
+ptrmap_slot(ptrmap *map, chunk *key)
+{
+  size_t i;
+
+  for (i = ptrmap_hash(key) & (map->size - 1);
+       map->keys[i] && map->keys[i] != key;
+       i = (i + 1) & (map->size - 1))
+    continue;
+
+  return i;
+}
+
+static bool
+ptrmap_put(ptrmap *map, chunk *key, size_t val)
+{
+  size_t i;
+
+  if ((map->used + 1) * 2 > map->size) {
+    ptrmap tmp = { NULL, NULL, map->size ? map->size * 2 : 64, 0 };
+
+    tmp.keys = (chunk**) calloc(tmp.size, sizeof(chunk*));
+    tmp.vals = (size_t*) calloc(tmp.size, sizeof(size_t));
+    if (!tmp.keys || !tmp.vals) {
+      free(tmp.keys);
+      free(tmp.vals);
+      return false;
+    }
+
+    for (i = 0; i < map->size; i++)
+      if (map->keys[i])
+        ptrmap_put(&tmp, map->keys[i], map->vals[i]);
+
+    free(map->keys);
+    free(map->vals);
+    *map = tmp;
+  }
+
+  i = ptrmap_slot(map, key);
+  if (!map->keys[i])
+    map->used++;
+  map->keys[i] = key;
+  map->vals[i] = val;
+  return true;
+}
+
+static bool
+ptrmap_get(ptrmap *map, chunk *key, size_t *val)
+{
+  size_t i;
+
+  if (map->size == 0 || !key)
+    return false;
+
+  i = ptrmap_slot(map, key);
+  if (!map->keys[i])
+    return false;
+
+  *val = map->vals[i];
+  return true;
+}
+
+/*
+ * Maps the payloads of out-of-line chunks to their headers. Those payloads
+ * are always OUTLINE_ALIGN aligned, so nothing else needs a lookup until
+ * one exists. The map is a radix tree over the address bits above that
+ * alignment, read without any lock: nodes are published with a CAS and
+ * never freed, and leaf slots are read and written atomically.
+ * outlined_count lets lookups skip the walk while nothing is outlined.
+ */
+static void *outlined[OUTLINE_FANOUT];
+static size_t outlined_count;
+
+/* Finds the leaf slot for payload, adding the nodes on the way if asked */
+static void **
+outline_slot(const void *payload, bool create)
+{
+  uint64_t key = (uintptr_t) payload / OUTLINE_ALIGN;
+  void **node = outlined;
+  int level;
+
+  if (key >> (OUTLINE_BITS * OUTLINE_LEVELS))
+    return NULL;
+
+  for (level = OUTLINE_LEVELS - 1; level > 0; level--) {
+    void **slot = &node[(key >> (OUTLINE_BITS * level)) & (OUTLINE_FANOUT - 1)];
+    void *next = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+
+    if (!next && create) {
+      void *tmp = calloc(OUTLINE_FANOUT, sizeof(void*));
+      if (!tmp)
+        return NULL;
+
+      /* Another thread may have added the same node first */
+      if (__atomic_compare_exchange_n(slot, &next, tmp, false,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        next = tmp;
+      else
+        free(tmp);
+    }
+
+    if (!next)
+      return NULL;
+    node = (void**) next;
+  }
+
+  return &node[key & (OUTLINE_FANOUT - 1)];
+}
+
+static bool
+outline_put(void *payload, chunk *chnk)
+{
+  void **slot = outline_slot(payload, true);
+
+  if (!slot) {
+    errno = ENOMEM;
+    return false;
+  }
+
+  __atomic_store_n(slot, (void*) chnk, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&outlined_count, 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+static void
+outline_remove(void *payload)
+{
+  void **slot = outline_slot(payload, false);
+
+  if (slot && __atomic_exchange_n(slot, NULL, __ATOMIC_ACQ_REL))
+    __atomic_sub_fetch(&outlined_count, 1, __ATOMIC_RELEASE);
+}
+
+static inline chunk *
+get_chunk(const void *mem)
+{
+  uintptr_t addr = (uintptr_t) mem;
+  void **slot;
+  chunk *chnk;
+
+  if (addr < sizeof(chunk))
+    return NULL;
+
+  if ((addr & (OUTLINE_ALIGN - 1)) == 0
+      && __atomic_load_n(&outlined_count, __ATOMIC_ACQUIRE) > 0
+      && (slot = outline_slot(mem, false))
+      && (chnk = (chunk*) __atomic_load_n(slot, __ATOMIC_ACQUIRE)))
+    return chnk;
+
+  return (chunk*) (addr - sizeof(chunk));
+}
+
+/*
+ * Interned strings, keyed by content; vals holds each string's hash.
+ * Interned chunks are shared between unrelated trees, so the table and
+ * the edges of those chunks are only touched under intern_lock.
+ */
+static ptrmap interned;
+static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t
+intern_hash(const char *str, size_t len)
+{
+  uint64_t h = 0xcbf29ce484222325ull;
+
+  while (len-- > 0)
+    h = (h ^ (unsigned char) *str++) * 0x100000001b3ull;
+
+  return (size_t) (h ^ (h >> 32));
+}
+
+static size_t
+intern_slot(const char *str, size_t len, size_t hash)
+{
+  size_t i;
+
+  for (i = hash & (interned.size - 1); interned.keys[i];
+       i = (i + 1) & (interned.size - 1)) {
+    chunk *chnk = interned.keys[i];
+    if (interned.vals[i] == hash && chnk->size == len + 1
+        && !memcmp(chnk + 1, str, len))
+      break;
+  }
+
+  return i;
+}
+
+static bool
+intern_put(chunk *chnk, size_t hash)
+{
+  ptrmap tmp;
+  size_t i;
+
+  if ((interned.used + 1) * 2 > interned.size) {
+    tmp = interned;
+    interned.size = tmp.size ? tmp.size * 2 : 64;
+    interned.used = 0;
+    interned.keys = (chunk**) calloc(interned.size, sizeof(chunk*));
+    interned.vals = (size_t*) calloc(interned.size, sizeof(size_t));
+    if (!interned.keys || !interned.vals) {
+      free(interned.keys);
+      free(interned.vals);
+      interned = tmp;
+      return false;
+    }
+
+    for (i = 0; i < tmp.size; i++)
+      if (tmp.keys[i])
+        intern_put(tmp.keys[i], tmp.vals[i]);
+
+    free(tmp.keys);
+    free(tmp.vals);
+  }
+
+  i = intern_slot(GET_ALLOC(chnk), chnk->size - 1, hash);
+  interned.keys[i] = chnk;
+  interned.vals[i] = hash;
+  interned.used++;
+  return true;
+}
+
+static void
+intern_remove(chunk *chnk)
+{
+  size_t mask = interned.size - 1, i, j, k;
+
+  i = intern_hash(GET_ALLOC(chnk), chnk->size - 1) & mask;
+  for (; interned.keys[i] != chnk; i = (i + 1) & mask)
+    continue;
+
+  /* Shift later entries of the probe sequence back into the hole */
+  for (j = (i + 1) & mask; interned.keys[j]; j = (j + 1) & mask) {
+    k = interned.vals[j] & mask;
+    if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+      interned.keys[i] = interned.keys[j];
+      interned.vals[i] = interned.vals[j];
+      i = j;
+    }
+  }
+
+  interned.keys[i] = NULL;
+  interned.used--;
+  chnk->flags &= ~SC_FLAGS_INTERN;
+}
+
+static ext *
+ext_get(chunk *chnk)
+{
+  if (!chnk->ext)
+    chnk->ext = (ext*) calloc(1, sizeof(ext));
+  return chnk->ext;
+}
+
+/* Applies a delta to the retained totals of chnk and every owner above it */
+static void
+charge(chunk *chnk, size_t bytes, size_t count, bool release)
+{
+  for (; chnk; chnk = chnk->ext->owner) {
+    if (release) {
+      chnk->ext->bytes -= bytes;
+      chnk->ext->count -= count;
+    } else {
+      chnk->ext->bytes += bytes;
+      chnk->ext->count += count;
+    }
+  }
+}
+
+static void
+unlink(chunk *prnt, chunk *chld, bool bothsides);
+
+static bool
+cache_full(chunk *cchnk, size_t bytes)
+{
+  cache *c = (cache*) GET_ALLOC(cchnk);
+
+  if (c->entries > 0 && c->stats.entries > c->entries)
+    return true;
+
+  return c->bytes > 0 && cchnk->ext->bytes - cchnk->size + bytes > c->bytes;
+}
+
+static void
+cache_remove(chunk *cchnk, chunk *chld)
+{
+  cache *c = (cache*) GET_ALLOC(cchnk);
+
+  if (chld->ext->newer)
+    chld->ext->newer->ext->older = chld->ext->older;
+  else
+    c->newest = chld->ext->older;
+
+  if (chld->ext->older)
+    chld->ext->older->ext->newer = chld->ext->newer;
+  else
+    c->oldest = chld->ext->newer;
+
+  chld->ext->newer = chld->ext->older = NULL;
+}
+
+static void
+cache_insert(chunk *cchnk, chunk *chld)
+{
+  cache *c = (cache*) GET_ALLOC(cchnk);
+
+  chld->ext->older = c->newest;
+  chld->ext->newer = NULL;
+  if (c->newest)
+    c->newest->ext->newer = chld;
+  else
+    c->oldest = chld;
+  c->newest = chld;
+}
+
+/*
+ * Evicts the oldest entries until bytes more fit in the cache. Entries that
+ * are still referenced elsewhere (or grouped) can't be reclaimed; they are
+ * moved to the front so that each entry is examined at most once.
+ */
+static void
+cache_evict(chunk *cchnk, chunk *keep, size_t bytes)
+{
+  cache *c = (cache*) GET_ALLOC(cchnk);
+  size_t tries = c->stats.entries;
+  chunk *tmp;
+
+  while (tries-- > 0 && cache_full(cchnk, bytes) && (tmp = c->oldest)) {
+    if (tmp == keep || tmp->parents.used != 1 || tmp->prev || tmp->next) {
+      cache_remove(cchnk, tmp);
+      cache_insert(cchnk, tmp);
+      continue;
+    }
+
+    c->stats.evictions++;
+    unlink(cchnk, tmp, true);
+  }
+}
+
+/*
+ * Checks that bytes more can be charged to chnk without exceeding a budget.
+ * Caches along the way make room by evicting, but never refuse.
+ */
+static bool
+budget(chunk *chnk, size_t bytes)
+{
+  chunk *prev = NULL;
+
+  for (; chnk; prev = chnk, chnk = chnk->ext->owner) {
+    if (chnk->flags & SC_FLAGS_CACHE)
+      cache_evict(chnk, prev, bytes);
+
+    if (chnk->ext->limit == 0 || chnk->ext->bytes + bytes <= chnk->ext->limit)
+      continue;
+
+    if (chnk->ext->budget && chnk->ext->budget(GET_ALLOC(chnk),
+                                               chnk->ext->bytes, bytes,
+                                               chnk->ext->misc))
+      continue;
+
+    errno = ENOMEM;
+    return false;
+  }
+
+  return true;
+}
+
+/* Makes prnt the owner of chld, unless doing so would create a cycle */
+static bool
+adopt(chunk *prnt, chunk *chld, bool check)
+{
+  chunk *tmp;
+
+  if (!prnt || !(prnt->flags & SC_FLAGS_ACCOUNT) || chld->ext->owner)
+    return true;
+
+  for (tmp = prnt; tmp; tmp = tmp->ext->owner)
+    if (tmp == chld)
+      return true;
+
+  if (check && !budget(prnt, chld->ext->bytes))
+    return false;
+
+  chld->ext->owner = prnt;
+  charge(prnt, chld->ext->bytes, chld->ext->count, false);
+  return true;
+}
+
+/* Releases chld from prnt, moving the charge to another parent if possible */
+static void
+disown(chunk *prnt, chunk *chld)
+{
+  size_t i;
+
+  if (!prnt || !(chld->flags & SC_FLAGS_ACCOUNT) || chld->ext->owner != prnt)
+    return;
+
+  charge(prnt, chld->ext->bytes, chld->ext->count, true);
+  chld->ext->owner = NULL;
+
+  for (i = 0; i < chld->parents.used && !chld->ext->owner; i++)
+    adopt(chld->parents.chunks[i], chld, false);
+}
+
+static bool
+account(chunk *chnk)
+{
+  size_t i;
+
+  if (chnk->flags & SC_FLAGS_ACCOUNT)
+    return true;
+
+  if (chnk->flags & SC_FLAGS_MAPPED)
+    return false;
+
+  if (!ext_get(chnk))
+    return false;
+
+  chnk->flags |= SC_FLAGS_ACCOUNT;
+  chnk->ext->owner = NULL;
+  chnk->ext->bytes = chnk->size;
+  chnk->ext->count = 1;
+
+  for (i = 0; i < chnk->children.used; i++) {
+    if (!account(chnk->children.chunks[i]))
+      return false;
+    adopt(chnk, chnk->children.chunks[i], false);
+  }
+
+  return true;
+}
+
+static bool
+pop_parent(chunk *chld, chunk *prnt)
+{
+  size_t i;
+
+  if (!pop(&chld->parents, prnt))
+    return false;
+
+  disown(prnt, chld);
+
+  if (prnt && chld->ext && chld->ext->cache == prnt) {
+    for (i = 0; i < chld->parents.used; i++)
+      if (chld->parents.chunks[i] == prnt)
+        return true;
+
+    cache_remove(prnt, chld);
+    chld->ext->cache = NULL;
+    ((cache*) GET_ALLOC(prnt))->stats.entries--;
+  }
+
+  return true;
+}
+
+static void
+weak_clear(chunk *chnk)
+{
+  weak *tmp;
+
+  for (tmp = chnk->ext->weak; tmp; tmp = tmp->next)
+    tmp->target = NULL;
+
+  chnk->ext->weak = NULL;
+  chnk->flags &= ~SC_FLAGS_WEAK;
+}
+
+static void
+weak_release(weak *wk)
+{
+  if (!wk->target)
+    return;
+
+  if (wk->prev)
+    wk->prev->next = wk->next;
+  else
+    wk->target->ext->weak = wk->next;
+
+  if (wk->next)
+    wk->next->prev = wk->prev;
+
+  if (!wk->target->ext->weak)
+    wk->target->flags &= ~SC_FLAGS_WEAK;
+  wk->target = NULL;
+}
+
+static void
+base_free(chunk *chnk)
+{
+  /* Parallel teardown may free chunks of one slab from several threads */
+  if (chnk->flags & SC_FLAGS_SLAB
+      && __atomic_sub_fetch(&((slab*) chnk->base)->live, 1, __ATOMIC_ACQ_REL))
+    return;
+
+  const scAllocator *be = backend(chnk);
+
+  if (chnk->flags & SC_FLAGS_SLAB) {
+    mem_free(be, chnk->base, ((slab*) chnk->base)->size);
+  } else if (chnk->flags & SC_FLAGS_OUTLINE) {
+    outline_remove(chnk->base);
+    mem_free(be, chnk->base, chnk->size);
+    if (be)
+      mem_free(be, (char*) chnk - BACKEND_PREFIX,
+               BACKEND_PREFIX + sizeof(chunk));
+    else
+      free(chnk);
+  } else {
+    mem_free(be, chnk->base,
+             (char*) (chnk + 1) - (char*) chnk->base + chnk->size);
+  }
+}
+
+#define sib_loop(chnk, tmp, code) \
+  for (chunk *step_, *tmp = chnk->prev; tmp; tmp = step_) { \
+    step_ = tmp->prev; \
+    code; \
+  } \
+  for (chunk *step_, *tmp = chnk; tmp; tmp = step_) { \
+    step_ = tmp->next; \
+    code; \
+  }
+
+static bool
+orphaned(chunk *chnk)
+{
+  size_t count = 0;
+  sib_loop(chnk, tmp, count += tmp->parents.used);
+  return count == 0;
+}
+
+/* Frees a group that no longer has any parents */
+static void
+destroy(chunk *chld)
+{
+  /* First loop: clear weak handles, call all destructors */
+  sib_loop(chld, tmp,
+    if (tmp->flags & SC_FLAGS_WEAK)
+      weak_clear(tmp);
+    if (tmp->flags & SC_FLAGS_INTERN) {
+      pthread_mutex_lock(&intern_lock);
+      intern_remove(tmp);
+      pthread_mutex_unlock(&intern_lock);
+    }
+    if (tmp->destructor)
+      tmp->destructor(GET_ALLOC(tmp));
+  );
+
+  /* Second loop: remove the children, do the free */
+  sib_loop(chld, tmp,
+    for (size_t i=tmp->children.used; i > 0; i--)
+      unlink(tmp, tmp->children.chunks[i-1], false);
+
+    if (tmp->flags & SC_FLAGS_WEAK_HANDLE)
+      weak_release((weak*) GET_ALLOC(tmp));
+
+    link_free(tmp, &tmp->children);
+    link_free(tmp, &tmp->parents);
+    free(tmp->ext);
+    base_free(tmp);
+  );
+}
+
+/*
+ * Pops an interned chunk's edge to prnt. If that was its last, the chunk
+ * leaves the table in the same step, so no other thread can pick it up.
+ */
+static bool
+intern_unlink(chunk *prnt, chunk *chld, bool *dead)
+{
+  bool popped;
+
+  pthread_mutex_lock(&intern_lock);
+  popped = pop_parent(chld, prnt);
+  *dead = orphaned(chld);
+  if (*dead) {
+    intern_remove(chld);
+    chld->flags &= ~SC_FLAGS_INTERN;
+  }
+  pthread_mutex_unlock(&intern_lock);
+
+  return popped;
+}
+
+static void
+unlink(chunk *prnt, chunk *chld, bool bothsides)
+{
+  bool popped, dead;
+
+  if (!chld)
+    return;
+
+  if (chld->flags & SC_FLAGS_INTERN) {
+    popped = intern_unlink(prnt, chld, &dead);
+  } else {
+    popped = pop_parent(chld, prnt);
+    dead = orphaned(chld);
+  }
+
+  if (popped && prnt && bothsides)
+    pop(&prnt->children, chld);
+
+  if (dead)
+    destroy(chld);
+}
+
+static chunk *
+_malloc(size_t size, const scAllocator *be)
+{
+  size_t prefix = be ? BACKEND_PREFIX : 0;
+  chunk *chnk;
+  char *tmp;
+
+  tmp = (char*) mem_alloc(be, prefix + sizeof(chunk) + size);
+  if (!tmp)
+    return NULL;
+
+  chnk = (chunk*) (tmp + prefix);
+  memset(chnk, 0, sizeof(chunk));
+  chnk->base = tmp;
+  if (be) {
+    ((const scAllocator**) chnk)[-1] = be;
+    chnk->flags = SC_FLAGS_BACKEND;
+  }
+  return chnk;
+}
+
+static chunk *
+_memalign(size_t size, size_t align, const scAllocator *be)
+{
+  size_t prefix = be ? BACKEND_PREFIX : 0;
+  chunk *chnk = NULL;
+  size_t header = 0;
+  int err = 0;
+  void *tmp;
+
+  /* Large alignments would mostly pad the header; keep it apart instead */
+  if (align >= OUTLINE_ALIGN) {
+    chnk = _malloc(0, be);
+    if (!chnk)
+      return NULL;
+
+    err = mem_memalign(be, &tmp, align, size);
+    if (err != 0 || !tmp) {
+      base_free(chnk);
+      errno = err ? err : ENOMEM;
+      return NULL;
+    }
+
+    if (!outline_put(tmp, chnk)) {
+      mem_free(be, tmp, size);
+      base_free(chnk);
+      return NULL;
+    }
+
+    chnk->base = tmp;
+    chnk->flags |= SC_FLAGS_OUTLINE;
+    chnk->align = __builtin_ctzl(align);
+    return chnk;
+  }
+
+  while (header < prefix + sizeof(chunk))
+    header += align;
+
+  err = mem_memalign(be, &tmp, align, header + size);
+  if (err != 0) {
+    errno = err;
+    return NULL;
+  }
+
+  /* Chunk data goes at the end of the header */
+  chnk = (chunk*) (((uintptr_t) tmp) + header - sizeof(chunk));
+  memset(chnk, 0, sizeof(chunk));
+  chnk->base = tmp;
+  chnk->align = __builtin_ctzl(align);
+  if (be) {
+    ((const scAllocator**) chnk)[-1] = be;
+    chnk->flags = SC_FLAGS_BACKEND;
+  }
+  return chnk;
+}
+
+/* The alignment a chunk was allocated with, zero if none was asked for */
+static size_t
+alignment(chunk *chnk)
+{
+  if (chnk->flags & SC_FLAGS_MAPPED || chnk->align == 0)
+    return 0;
+
+  return (size_t) 1 << chnk->align;
+}
+
+/* Moves an out-of-line payload; its header and edges stay where they are */
+static bool
+outline_resize(chunk *chnk, size_t size, size_t align)
+{
+  const scAllocator *be = backend(chnk);
+  void *tmp;
+  int err;
+
+  if (align < alignment(chnk))
+    align = alignment(chnk);
+
+  /* Backends are told the size they free, so only shrink in place without */
+  if (!be && size <= chnk->size && ((uintptr_t) chnk->base & (align - 1)) == 0)
+    return true;
+
+  err = mem_memalign(be, &tmp, align, size);
+  if (err != 0 || !tmp) {
+    errno = err ? err : ENOMEM;
+    return false;
+  }
+
+  if (!outline_put(tmp, chnk)) {
+    mem_free(be, tmp, size);
+    return false;
+  }
+
+  memcpy(tmp, chnk->base, chnk->size < size ? chnk->size : size);
+  outline_remove(chnk->base);
+  mem_free(be, chnk->base, chnk->size);
+  chnk->base = tmp;
+  chnk->align = __builtin_ctzl(align);
+  return true;
+}
+
+static bool
+incref(chunk *prnt, chunk *chld, bool check)
+{
+  if (IS_MAPPED(prnt) || IS_MAPPED(chld))
+    return false;
+
+  if (!push(chld, &(chld->parents), prnt))
+    return false;
+
+  if (prnt && !push(prnt, &(prnt->children), chld)) {
+    pop(&(chld->parents), prnt);
+    return false;
+  }
+
+  if (prnt && prnt->flags & SC_FLAGS_ACCOUNT
+           && (!account(chld) || !adopt(prnt, chld, check))) {
+    pop(&(prnt->children), chld);
+    pop(&(chld->parents), prnt);
+    return false;
+  }
+
+  if (prnt && prnt->flags & SC_FLAGS_CACHE && !chld->ext->cache) {
+    cache *c = (cache*) GET_ALLOC(prnt);
+
+    chld->ext->cache = prnt;
+    chld->ext->slot = prnt->children.used - 1;
+    if (prnt->children.chunks[chld->ext->slot] != chld)
+      /* Accounting evicted entries and moved the new edge */
+      chld->ext->slot = find(prnt->children.chunks, prnt->children.used, chld);
+    cache_insert(prnt, chld);
+    c->stats.entries++;
+    c->stats.misses++;
+    cache_evict(prnt, chld, 0);
+  }
+
+  return true;
+}
+
+void *
+_sc_alloc(void *parent, size_t size, size_t count, size_t align,
+           const char *tag, const char *location)
+{
+  chunk *prnt = GET_CHUNK(parent);
+  chunk *chnk = NULL;
+
+  if (IS_MAPPED(prnt))
+    return NULL;
+
+  if (prnt && prnt->flags & SC_FLAGS_ACCOUNT && !budget(prnt, size * count))
+    return NULL;
+
+  if (align == 0)
+    chnk = _malloc(size * count, backend(prnt));
+  else
+    chnk = _memalign(size * count, align, backend(prnt));
+  if (!chnk)
+    return NULL;
+
+  chnk->size = size * count;
+  chnk->tag = (char*) tag;
+  chnk->tagid = tag_hash(tag);
+
+  if (!incref(prnt, chnk, false)) {
+    free(chnk->ext);
+    base_free(chnk);
+    return NULL;
+  }
+
+  return GET_ALLOC(chnk);
+}
+
+void *
+_sc_alloc0(void *parent, size_t size, size_t count, size_t align,
+            const char *tag, const char *location)
+{
+  void *tmp = _sc_alloc(parent, size, count, align, tag, location);
+  if (tmp)
+    memset(tmp, 0, size * count);
+  return tmp;
+}
+
+/* Clones keep the tags of mapped chunks in their slab; copy them out */
+static bool
+own_tag(chunk *chnk)
+{
+  uintptr_t tag = (uintptr_t) chnk->tag, base = (uintptr_t) chnk->base;
+  char *tmp;
+
+  if (!(chnk->flags & SC_FLAGS_SLAB) || chnk->flags & SC_FLAGS_TAG_ALLOCATED
+      || tag < base || tag >= base + ((slab*) chnk->base)->size)
+    return true;
+
+  tmp = sc_strdup(GET_ALLOC(chnk), chnk->tag);
+  if (!tmp)
+    return false;
+
+  chnk->tag = tmp;
+  chnk->flags |= SC_FLAGS_TAG_ALLOCATED;
+  return true;
+}
+
+bool
+_sc_resizea(void **mem, size_t size, size_t count, size_t align)
+{
+  chunk *chnk, *tmp;
+  void *old;
+  size_t i;
+
+  chnk = GET_CHUNK(mem ? *mem : NULL);
+  if (!chnk || chnk->flags & (SC_FLAGS_MAPPED | SC_FLAGS_INTERN
+                               | SC_FLAGS_WEAK_HANDLE))
+    return false;
+
+  if (chnk->flags & SC_FLAGS_ACCOUNT && size * count > chnk->size
+      && !budget(chnk, size * count - chnk->size))
+    return false;
+
+  /* Aligned chunks stay aligned */
+  old = GET_ALLOC(chnk);
+  if (align == 0)
+    align = alignment(chnk);
+
+  if (chnk->flags & SC_FLAGS_OUTLINE) {
+    if (!outline_resize(chnk, size * count, align))
+      return false;
+
+    tmp = chnk;
+  } else if (align == 0 && !(chnk->flags & SC_FLAGS_SLAB)) {
+    size_t header = (char*) chnk - (char*) chnk->base;
+    char *base;
+
+    base = (char*) mem_realloc(backend(chnk), chnk->base,
+                               header + sizeof(chunk) + chnk->size,
+                               header + sizeof(chunk) + size * count);
+    if (!base)
+      return false;
+
+    tmp = (chunk*) (base + header);
+    tmp->base = base;
+  } else {
+    uint16_t outline;
+    uint8_t tmpalign;
+    void *tmpbase;
+
+    tmp = align == 0 ? _malloc(size * count, backend(chnk))
+                     : _memalign(size * count, align, backend(chnk));
+    if (!tmp)
+      return false;
+
+    /* Chunks leaving a slab must take their edges and tag with them */
+    if (!own(chnk, &chnk->parents) || !own(chnk, &chnk->children)
+        || !own_tag(chnk)) {
+      base_free(tmp);
+      return false;
+    }
+
+    tmpbase = tmp->base;
+    tmpalign = tmp->align;
+    outline = tmp->flags & SC_FLAGS_OUTLINE;
+    memcpy(tmp, chnk, sizeof(chunk));
+    tmp->base = tmpbase;
+    tmp->align = tmpalign;
+    tmp->flags = (tmp->flags & ~SC_FLAGS_SLAB) | outline;
+    memcpy(PAYLOAD(tmp), old,
+           chnk->size < size * count ? chnk->size : size * count);
+    base_free(chnk);
+  }
+
+  /* Slices follow the payload of their source */
+  if (GET_ALLOC(tmp) != old) {
+    for (i = 0; i < tmp->parents.used; i++) {
+      if (tmp->parents.chunks[i]
+          && tmp->parents.chunks[i]->flags & SC_FLAGS_SLICE) {
+        slice *slc = (slice*) GET_ALLOC(tmp->parents.chunks[i]);
+        if (slc->source == old) {
+          slc->view.data = (char*) GET_ALLOC(tmp)
+                           + (slc->view.data - slc->source);
+          slc->source = (char*) GET_ALLOC(tmp);
+        }
+      }
+    }
+  }
+
+  /* If the header was reallocated, we have to update references */
+  if (tmp != chnk) {
+    /* Update parents */
+    for (i = 0; i < tmp->parents.used; i++)
+      if (tmp->parents.chunks[i])
+        relink(&tmp->parents.chunks[i]->children, chnk, tmp);
+
+    /* Update children */
+    for (i = 0; i < tmp->children.used; i++) {
+      relink(&tmp->children.chunks[i]->parents, chnk, tmp);
+
+      if (tmp->children.chunks[i]->flags & SC_FLAGS_ACCOUNT
+          && tmp->children.chunks[i]->ext->owner == chnk)
+        tmp->children.chunks[i]->ext->owner = tmp;
+
+      if (tmp->children.chunks[i]->ext
+          && tmp->children.chunks[i]->ext->cache == chnk)
+        tmp->children.chunks[i]->ext->cache = tmp;
+    }
+
+    /* Update weak handles */
+    if (tmp->flags & SC_FLAGS_WEAK)
+      for (weak *wk = tmp->ext->weak; wk; wk = wk->next)
+        wk->target = tmp;
+
+    /* Update cache order */
+    if (tmp->ext && tmp->ext->cache) {
+      cache *c = (cache*) GET_ALLOC(tmp->ext->cache);
+
+      if (tmp->ext->newer)
+        tmp->ext->newer->ext->older = tmp;
+      else
+        c->newest = tmp;
+
+      if (tmp->ext->older)
+        tmp->ext->older->ext->newer = tmp;
+      else
+        c->oldest = tmp;
+    }
+
+    /* Update cousins */
+    if (tmp->next)
+      tmp->next->prev = tmp;
+    if (tmp->prev)
+      tmp->prev->next = tmp;
+  }
+
+  /* Slices never reach past the end of their source */
+  if (size * count < tmp->size) {
+    for (i = 0; i < tmp->parents.used; i++) {
+      if (tmp->parents.chunks[i]
+          && tmp->parents.chunks[i]->flags & SC_FLAGS_SLICE) {
+        slice *slc = (slice*) GET_ALLOC(tmp->parents.chunks[i]);
+        size_t off = slc->view.data - slc->source;
+        if (slc->source == GET_ALLOC(tmp) && off + slc->view.len > size * count)
+          slc->view.len = off < size * count ? size * count - off : 0;
+      }
+    }
+  }
+
+  if (tmp->flags & SC_FLAGS_ACCOUNT) {
+    if (size * count > tmp->size)
+      charge(tmp, size * count - tmp->size, 0, false);
+    else
+      charge(tmp, tmp->size - size * count, 0, true);
+  }
+
+  tmp->size = size * count;
+  *mem = GET_ALLOC(tmp);
+  return true;
+}
+
+bool
+_sc_resizea0(void **mem, size_t size, size_t count, size_t align)
+{
+  chunk *chnk = GET_CHUNK(mem ? *mem : NULL);
+  if (!chnk)
+    return false;
+  size_t oldsize = chnk->size;
+
+  if (!_sc_resizea(mem, size, count, align))
+    return false;
+
+  chnk = GET_CHUNK(mem ? *mem : NULL);
+  if (!chnk)
+    return false;
+  if (size * count > oldsize)
+    memset(((char *) *mem) + oldsize, 0, size * count - oldsize);
+  return true;
+}
+
+void *
+_sc_incref(void *parent, void *child, const char *location)
+{
+  chunk *chld = GET_CHUNK(child);
+  bool ok;
+
+  if (!chld)
+    return NULL;
+
+  if (chld->flags & SC_FLAGS_INTERN) {
+    pthread_mutex_lock(&intern_lock);
+    ok = incref(GET_CHUNK(parent), chld, true);
+    pthread_mutex_unlock(&intern_lock);
+  } else {
+    ok = incref(GET_CHUNK(parent), chld, true);
+  }
+
+  return ok ? child : NULL;
+}
+
+void
+_sc_decref(void *parent, void *child, const char *location)
+{
+  chunk *chld = GET_CHUNK(child);
+  if (!IS_MAPPED(chld))
+    unlink(GET_CHUNK(parent), chld, true);
+}
+
+/*
+ * Drops every child edge of prnt for which drop() returns true. The
+ * children array is compacted in one sweep and the matching parent edges
+ * popped before any group is freed, so a destructor can't see prnt half
+ * pruned and freeing prnt itself along the way is harmless.
+ */
+static void
+prune(chunk *prnt, bool (*drop)(chunk*, void*), void *arg)
+{
+  link *lnk = &prnt->children;
+  size_t i, j, n = 0;
+  chunk **dead;
+
+  dead = (chunk**) malloc(sizeof(chunk*) * lnk->used);
+  if (!dead) {
+    /* Fall back to dropping edges one at a time, from the back */
+    for (i = lnk->used; i > 0; i--) {
+      chunk *chld = lnk->chunks[i-1];
+      if (!drop(chld, arg))
+        continue;
+      move(lnk, --lnk->used, i-1);
+      unlink(prnt, chld, false);
+    }
+    return;
+  }
+
+  for (i = j = 0; i < lnk->used; i++) {
+    if (drop(lnk->chunks[i], arg))
+      dead[n++] = lnk->chunks[i];
+    else
+      move(lnk, i, j++);
+  }
+  lnk->used = j;
+
+  /* A group is orphaned by exactly one of its dropped edges, the last */
+  for (i = j = 0; i < n; i++) {
+    bool orphan;
+
+    if (dead[i]->flags & SC_FLAGS_INTERN) {
+      intern_unlink(prnt, dead[i], &orphan);
+    } else {
+      pop_parent(dead[i], prnt);
+      orphan = orphaned(dead[i]);
+    }
+    if (orphan)
+      dead[j++] = dead[i];
+  }
+
+  for (i = 0; i < j; i++)
+    destroy(dead[i]);
+
+  free(dead);
+}
+
+static bool
+drop_counted(chunk *chld, void *arg)
+{
+  ptrmap *map = (ptrmap*) arg;
+  size_t i = ptrmap_slot(map, chld);
+
+  if (!map->keys[i] || map->vals[i] == 0)
+    return false;
+
+  map->vals[i]--;
+  return true;
+}
+
+static bool
+drop_matching(chunk *chld, void *arg)
+{
+  void **cb = (void**) arg;
+  return ((scPrune*) cb[0])(GET_ALLOC(chld), cb[1]);
+}
+
+void
+sc_decref_many(void *parent, void **children, size_t n)
+{
+  chunk *prnt = GET_CHUNK(parent);
+  ptrmap map = { NULL, NULL, 64, 0 };
+  size_t count, i;
+  bool ok = true;
+
+  /* Size the map up front so it never rehashes */
+  while (prnt && map.size < n * 2 + 2)
+    map.size *= 2;
+  if (prnt && n > 0) {
+    map.keys = (chunk**) calloc(map.size, sizeof(chunk*));
+    map.vals = (size_t*) calloc(map.size, sizeof(size_t));
+    ok = map.keys && map.vals;
+  }
+  if (!map.keys)
+    map.size = 0;
+
+  for (i = 0; ok && prnt && i < n; i++) {
+    chunk *chld = GET_CHUNK(children[i]);
+    if (!chld || IS_MAPPED(chld))
+      continue;
+    if (!ptrmap_get(&map, chld, &count))
+      count = 0;
+    ok = ptrmap_put(&map, chld, count + 1);
+  }
+
+  if (ok && map.used > 0) {
+    prune(prnt, drop_counted, &map);
+  } else if (!ok || !prnt) {
+    for (i = 0; i < n; i++) {
+      chunk *chld = GET_CHUNK(children[i]);
+      if (!IS_MAPPED(chld))
+        unlink(prnt, chld, true);
+    }
+  }
+
+  free(map.keys);
+  free(map.vals);
+}
+
+void
+sc_prune(void *parent, scPrune *fn, void *arg)
+{
+  chunk *prnt = GET_CHUNK(parent);
+  void *cb[] = { (void*) fn, arg };
+
+  if (prnt && fn && !IS_MAPPED(prnt))
+    prune(prnt, drop_matching, cb);
+}
+
+/*
+ * Parallel teardown runs in two phases. In the first, workers take dead
+ * groups from their own deque (or steal from another's), run the group's
+ * destructors and drop its child edges, queueing any child group that dies
+ * as a result. In the second, each worker frees the groups it collected.
+ * No memory is therefore freed until every destructor has run.
+ */
+#define TEARDOWN_STRIPES 64
+
+typedef struct teardown teardown;
+typedef struct worker worker;
+
+struct worker {
+  pthread_mutex_t lock;
+  pthread_t thread;
+  teardown *td;
+  chunk **tasks;
+  size_t bottom;
+  size_t top;
+  size_t size;
+  chunk *dead;
+};
+
+struct teardown {
+  pthread_mutex_t stripes[TEARDOWN_STRIPES];
+  pthread_mutex_t global;
+  worker *workers;
+  size_t count;
+  size_t pending;
+};
+
+static void
+teardown_group(worker *w, chunk *chnk);
+
+static void
+teardown_push(worker *w, chunk *chnk)
+{
+  chunk **tmp;
+
+  __atomic_add_fetch(&w->td->pending, 1, __ATOMIC_SEQ_CST);
+
+  pthread_mutex_lock(&w->lock);
+  if (w->top == w->size) {
+    tmp = realloc(w->tasks, sizeof(chunk*) * (w->size ? w->size * 2 : 64));
+    if (!tmp) {
+      /* Out of memory: do the work here rather than queue it */
+      pthread_mutex_unlock(&w->lock);
+      teardown_group(w, chnk);
+      __atomic_sub_fetch(&w->td->pending, 1, __ATOMIC_SEQ_CST);
+      return;
+    }
+
+    w->tasks = tmp;
+    w->size = w->size ? w->size * 2 : 64;
+  }
+  w->tasks[w->top++] = chnk;
+  pthread_mutex_unlock(&w->lock);
+}
+
+static chunk *
+teardown_take(worker *w, bool steal)
+{
+  chunk *chnk = NULL;
+
+  pthread_mutex_lock(&w->lock);
+  if (w->top > w->bottom)
+    chnk = steal ? w->tasks[w->bottom++] : w->tasks[--w->top];
+  if (w->top == w->bottom)
+    w->top = w->bottom = 0;
+  pthread_mutex_unlock(&w->lock);
+
+  return chnk;
+}
+
+static void
+teardown_edge(worker *w, chunk *prnt, chunk *chld)
+{
+  pthread_mutex_t *stripe;
+  size_t count = 0;
+  chunk *head;
+
+  /* Any chunk of a group may be reached from another worker; lock on one */
+  for (head = chld; head->prev; head = head->prev)
+    continue;
+
+  if (chld->flags & SC_FLAGS_INTERN) {
+    bool dead;
+
+    pthread_mutex_lock(&w->td->global);
+    intern_unlink(prnt, chld, &dead);
+    pthread_mutex_unlock(&w->td->global);
+    if (dead)
+      teardown_push(w, head);
+    return;
+  }
+
+  stripe = &w->td->stripes[((uintptr_t) head >> 4) % TEARDOWN_STRIPES];
+
+  pthread_mutex_lock(stripe);
+  if (chld->ext) {
+    /* Accounting and caches reach outside the subtree */
+    pthread_mutex_lock(&w->td->global);
+    pop_parent(chld, prnt);
+    pthread_mutex_unlock(&w->td->global);
+  } else {
+    pop(&chld->parents, prnt);
+  }
+  sib_loop(head, tmp, count += tmp->parents.used);
+  pthread_mutex_unlock(stripe);
+
+  if (count == 0)
+    teardown_push(w, head);
+}
+
+static void
+teardown_group(worker *w, chunk *chnk)
+{
+  sib_loop(chnk, tmp,
+    if (tmp->flags & SC_FLAGS_WEAK)
+      weak_clear(tmp);
+    if (tmp->flags & SC_FLAGS_INTERN) {
+      pthread_mutex_lock(&intern_lock);
+      intern_remove(tmp);
+      pthread_mutex_unlock(&intern_lock);
+    }
+    if (tmp->destructor)
+      tmp->destructor(GET_ALLOC(tmp));
+  );
+
+  /* The group links are dead too, so reuse next for the free list */
+  sib_loop(chnk, tmp,
+    for (size_t i=tmp->children.used; i > 0; i--)
+      teardown_edge(w, tmp, tmp->children.chunks[i-1]);
+
+    tmp->next = w->dead;
+    w->dead = tmp;
+  );
+}
+
+static void
+teardown_free(worker *w)
+{
+  chunk *next;
+
+  for (chunk *tmp = w->dead; tmp; tmp = next) {
+    next = tmp->next;
+
+    if (tmp->flags & SC_FLAGS_WEAK_HANDLE) {
+      pthread_mutex_lock(&w->td->global);
+      weak_release((weak*) GET_ALLOC(tmp));
+      pthread_mutex_unlock(&w->td->global);
+    }
+
+    free(tmp->ext);
+
+    /* Backends aren't safe to use from several threads */
+    if (tmp->flags & SC_FLAGS_BACKEND) {
+      pthread_mutex_lock(&w->td->global);
+      link_free(tmp, &tmp->children);
+      link_free(tmp, &tmp->parents);
+      base_free(tmp);
+      pthread_mutex_unlock(&w->td->global);
+    } else {
+      link_free(tmp, &tmp->children);
+      link_free(tmp, &tmp->parents);
+      base_free(tmp);
+    }
+  }
+
+  w->dead = NULL;
+}
+
+static void *
+teardown_work(void *misc)
+{
+  worker *w = misc;
+  teardown *td = w->td;
+  chunk *chnk;
+  size_t i;
+
+  for (;;) {
+    chnk = teardown_take(w, false);
+    for (i = 1; !chnk && i < td->count; i++)
+      chnk = teardown_take(&td->workers[(w - td->workers + i) % td->count],
+                           true);
+
+    if (chnk) {
+      teardown_group(w, chnk);
+      __atomic_sub_fetch(&td->pending, 1, __ATOMIC_SEQ_CST);
+    } else if (__atomic_load_n(&td->pending, __ATOMIC_SEQ_CST) == 0) {
+      return NULL;
+    } else {
+      sched_yield();
+    }
+  }
+}
+
+static void *
+teardown_reap(void *misc)
+{
+  teardown_free(misc);
+  return NULL;
+}
+
+static void
+teardown_run(teardown *td, void *(*func)(void*))
+{
+  size_t i, started;
+
+  for (started = 1; started < td->count; started++) {
+    worker *w = &td->workers[started];
+    if (pthread_create(&w->thread, NULL, func, w) != 0)
+      break;
+  }
+
+  func(&td->workers[0]);
+  for (i = started; i < td->count; i++)
+    func(&td->workers[i]);
+
+  for (i = 1; i < started; i++)
+    pthread_join(td->workers[i].thread, NULL);
+}
+
+void
+sc_decref_parallel(void *parent, void *child, size_t threads)
+{
+  chunk *chld = GET_CHUNK(child);
+  chunk *prnt = GET_CHUNK(parent);
+  bool popped, dead;
+  teardown td;
+  size_t i;
+
+  if (!chld || IS_MAPPED(chld))
+    return;
+
+  if (threads == 0) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = n > 0 ? n : 1;
+  }
+
+  memset(&td, 0, sizeof(td));
+  if (threads > 1)
+    td.workers = calloc(threads, sizeof(worker));
+  if (!td.workers) {
+    unlink(prnt, chld, true);
+    return;
+  }
+
+  if (chld->flags & SC_FLAGS_INTERN) {
+    popped = intern_unlink(prnt, chld, &dead);
+  } else {
+    popped = pop_parent(chld, prnt);
+    dead = orphaned(chld);
+  }
+
+  if (popped && prnt)
+    pop(&prnt->children, chld);
+
+  if (dead) {
+    td.count = threads;
+    td.pending = 1;
+    pthread_mutex_init(&td.global, NULL);
+    for (i = 0; i < TEARDOWN_STRIPES; i++)
+      pthread_mutex_init(&td.stripes[i], NULL);
+    for (i = 0; i < threads; i++) {
+      pthread_mutex_init(&td.workers[i].lock, NULL);
+      td.workers[i].td = &td;
+    }
+
+    td.workers[0].tasks = malloc(sizeof(chunk*) * 64);
+    if (td.workers[0].tasks) {
+      td.workers[0].size = 64;
+      td.workers[0].tasks[td.workers[0].top++] = chld;
+    } else {
+      teardown_group(&td.workers[0], chld);
+      td.pending--;
+    }
+
+    teardown_run(&td, teardown_work);
+    teardown_run(&td, teardown_reap);
+
+    for (i = 0; i < threads; i++) {
+      pthread_mutex_destroy(&td.workers[i].lock);
+      free(td.workers[i].tasks);
+    }
+    for (i = 0; i < TEARDOWN_STRIPES; i++)
+      pthread_mutex_destroy(&td.stripes[i]);
+    pthread_mutex_destroy(&td.global);
+  }
+
+  free(td.workers);
+}
+
+void *
+_sc_steal(void *parent, void *child, void *pold, const char *location)
+{
+  chunk *chld = GET_CHUNK(child);
+  chunk *prnt = GET_CHUNK(pold);
+  int i;
+
+  if (!chld || (pold && !prnt) || (!pold && chld->parents.used != 1)
+      || IS_MAPPED(chld))
+    return NULL;
+
+  if (!pold)
+    prnt = chld->parents.chunks[0];
+
+  for (i = 0; i < chld->parents.used; i++) {
+    if (chld->parents.chunks[i] == prnt) {
+      bool shared = chld->flags & SC_FLAGS_INTERN;
+
+      if (shared)
+        pthread_mutex_lock(&intern_lock);
+      if (prnt)
+        pop(&prnt->children, chld);
+      pop_parent(chld, prnt);
+      if (shared)
+        pthread_mutex_unlock(&intern_lock);
+
+      if (_sc_incref(parent, child, location))
+        return child;
+
+      /* Refused by a budget: the popped edges left room to restore it */
+      if (shared)
+        pthread_mutex_lock(&intern_lock);
+      incref(prnt, chld, false);
+      if (shared)
+        pthread_mutex_unlock(&intern_lock);
+      return NULL;
+    }
+  }
+
+  return NULL;
+}
+
+void
+_sc_destructor_set(void *mem, scFree *destructor)
+{
+  chunk *chnk = GET_CHUNK(mem);
+  if (chnk && !IS_MAPPED(chnk))
+    chnk->destructor = destructor;
+}
+
+void *
+sc_ensure_tag(void *mem, const char *tag)
+{
+  const char *t = sc_tag_get(mem);
+
+  if (!t || !tag || strcmp(t, tag))
+    return NULL;
+
+  return mem;
+}
+
+void
+sc_group(void *cousin, void *mem)
+{
+  chunk *chnk = GET_CHUNK(mem);
+  chunk *csnc = GET_CHUNK(cousin);
+  if (!chnk || !csnc || IS_MAPPED(chnk) || IS_MAPPED(csnc))
+    return;
+
+  chunk *head = chnk;
+  chunk *tail = chnk;
+  while (head->prev)
+    head = head->prev;
+  while (tail->next)
+    tail = tail->next;
+
+  if (csnc->next)
+    csnc->next->prev = tail;
+  tail->next = csnc->next;
+  csnc->next = head;
+  head->prev = csnc;
+}
+
+size_t
+sc_size(void *mem)
+{
+  chunk *chnk = GET_CHUNK(mem);
+  if (chnk)
+    return chnk->size;
+  return 0;
+}
+
+size_t
+sc_size_retained(void *mem)
+{
+  chunk *chnk = GET_CHUNK(mem);
+  if (chnk && chnk->flags & SC_FLAGS_ACCOUNT)
+    return chnk->ext->bytes;
+  return sc_size(mem);
+}
+
+size_t
+sc_size_retained_chunks(void *mem)
+{
+  chunk *chnk = GET_CHUNK(mem);
+  if (chnk && chnk->flags & SC_FLAGS_ACCOUNT)
+    return chnk->ext->count;
+  return chnk ? 1 : 0;
+}
+
+bool
+sc_account(void *mem)
+{
+  chunk *chnk = GET_CHUNK(mem);
+  return chnk && account(chnk);
+}
+
+bool
+_sc_budget_set(void *mem, size_t limit, scBudget *cb, void *misc)
+{
+  chunk *chnk = GET_CHUNK(mem);
+  if (!chnk || !account(chnk))
+    return false;
+
+  chnk->ext->limit = limit;
+  chnk->ext->budget = cb;
+  chnk->ext->misc = misc;
+  return true;
+}
+
+void *
+sc_context_new(void *parent, const scAllocator *be)
+{
+  chunk *prnt = GET_CHUNK(parent);
+  chunk *chnk;
+
+  if (!be || !be->alloc || !be->free || IS_MAPPED(prnt))
+    return NULL;
+
+  chnk = _malloc(0, be);
+  if (!chnk)
+    return NULL;
+
+  retag(chnk, "scContext");
+  if (!incref(prnt, chnk, false)) {
+    free(chnk->ext);
+    base_free(chnk);
+    return NULL;
+  }
+
+  return GET_ALLOC(chnk);
+}
+
+void *
+sc_cache_new(void *parent, size_t bytes, size_t entries)
+{
+  cache *c;
+  chunk *chnk;
+
+  c = sc_new0(parent, cache);
+  if (!c)
+    return NULL;
+
+  chnk = GET_CHUNK(c);
+  if (!account(chnk)) {
+    sc_decref(parent, c);
+    return NULL;
+  }
+
+  retag(chnk, "scCache");
+  chnk->flags |= SC_FLAGS_CACHE;
+  c->bytes = bytes;
+  c->entries = entries;
+  return c;
+}
+
+bool
+sc_cache_limits_set(void *mem, size_t bytes, size_t entries)
+{
+  chunk *chnk = GET_CHUNK(mem);
+  if (!chnk || !(chnk->flags & SC_FLAGS_CACHE))
+    return false;
+
+  ((cache*) mem)->bytes = bytes;
+  ((cache*) mem)->entries = entries;
+  cache_evict(chnk, NULL, 0);
+  return true;
+}
+
+bool
+sc_cache_touch(void *mem)
+{
+  chunk *chnk = GET_CHUNK(mem);
+  if (!chnk || !chnk->ext || !chnk->ext->cache)
+    return false;
+
+  cache_remove(chnk->ext->cache, chnk);
+  cache_insert(chnk->ext->cache, chnk);
+  ((cache*) GET_ALLOC(chnk->ext->cache))->stats.hits++;
+  return true;
+}
+
+bool
+sc_cache_stats(void *mem, scCacheStats *stats)
+{
+  chunk *chnk = GET_CHUNK(mem);
+  if (!chnk || !(chnk->flags & SC_FLAGS_CACHE) || !stats)
+    return false;
+
+  *stats = ((cache*) mem)->stats;
+  stats->bytes = chnk->ext->bytes - chnk->size;
+  return true;
+}
+
+void *
+sc_weak_new(void *parent, void *mem)
+{
+  chunk *chnk = GET_CHUNK(mem);
+  weak *wk;
+
+  if (!chnk || IS_MAPPED(chnk) || !ext_get(chnk))
+    return NULL;
+
+  wk = sc_new0(parent, weak);
+  if (!wk)
+    return NULL;
+
+  retag(GET_CHUNK(wk), "scWeak");
+  GET_CHUNK(wk)->flags |= SC_FLAGS_WEAK_HANDLE;
+  wk->target = chnk;
+  wk->next = chnk->ext->weak;
+  if (wk->next)
+    wk->next->prev = wk;
+  chnk->ext->weak = wk;
+  chnk->flags |= SC_FLAGS_WEAK;
+  return wk;
+}
+
+void *
+sc_weak_get(void *mem)
+{
+  chunk *chnk = GET_CHUNK(mem);
+  if (!chnk || !(chnk->flags & SC_FLAGS_WEAK_HANDLE))
+    return NULL;
+
+  return GET_ALLOC(((weak*) mem)->target);
+}
+
+size_t
+sc_size_parents_tag(void *mem, const char *tag)
+{
+  chunk *chnk = GET_CHUNK(mem);
+  if (!chnk)
+    return 0;
+
+  if (!tag)
+    return chnk->parents.used;
+
+  if (!IS_MAPPED(chnk))
+    return simd.count(chnk->parents.chunks, LINK_IDS(&chnk->parents),
+                      chnk->parents.used, tag_hash(tag), tag);
+
+  size_t i, count;
+  for (i=0, count=0; i < chnk->parents.used; i++) {
+    const char *t = tag_get(link_get(chnk, &chnk->parents, i));
+    if (t && !strcmp(t, tag))
+      count++;
+  }
+
+  return count;
+}
+
+size_t
+sc_size_children_tag(void *mem, const char *tag)
+{
+  chunk *chnk = GET_CHUNK(mem);
+  if (!chnk)
+    return 0;
+
+  if (!tag)
+    return chnk->children.used;
+
+  if (!IS_MAPPED(chnk))
+    return simd.count(chnk->children.chunks, LINK_IDS(&chnk->children),
+                      chnk->children.used, tag_hash(tag), tag);
+
+  size_t i, count;
+  for (i=0, count=0; i < chnk->children.used; i++) {
+    const char *t = tag_get(link_get(chnk, &chnk->children, i));
+    if (t && !strcmp(t, tag))
+      count++;
+  }
+
+  return count;
+}
+
+bool
+sc_tag_set(void *mem, const char *fmt, ...)
+{
+  va_list ap;
+  chunk *chnk;
+  char *tmp;
+
+  chnk = GET_CHUNK(mem);
+  if (!chnk || !fmt || IS_MAPPED(chnk))
+    return false;
+
+  va_start(ap, fmt);
+  tmp = sc_vasprintf(mem, fmt, ap);
+  va_end(ap);
+  if (!tmp)
+    return false;
+
+  if (chnk->tag && chnk->flags & SC_FLAGS_TAG_ALLOCATED)
+    sc_decref(mem, chnk->tag);
+
+  retag(chnk, tmp);
+  chnk->flags |= SC_FLAGS_TAG_ALLOCATED;
+  return true;
+}
+
+bool
+sc_tag_set_const(void *mem, const char *tag)
+{
+  chunk *chnk = GET_CHUNK(mem);
+  if (!chnk || IS_MAPPED(chnk))
+    return false;
+
+  if (chnk->tag && chnk->flags & SC_FLAGS_TAG_ALLOCATED)
+    sc_decref(mem, chnk->tag);
+
+  retag(chnk, tag);
+  chnk->flags &= ~SC_FLAGS_TAG_ALLOCATED;
+  return true;
+}
+
+const char *
+sc_tag_get(void *mem)
+{
+  chunk *chnk = GET_CHUNK(mem);
+  return chnk ? tag_get(chnk) : NULL;
+}
+
+char *
+sc_strdup(void *parent, const char *str)
+{
+  if (!str)
+    return NULL;
+  return sc_strndup(parent, str, strlen(str));
+}
+
+char *
+sc_strndup(void *parent, const char *str, size_t len)
+{
+  char *tmp;
+
+  if (!str)
+    return NULL;
+
+  tmp = sc_newa(parent, char, len + 1);
+  if (tmp) {
+    strncpy(tmp, str, len);
+    tmp[len] = '\0';
+  }
+  return tmp;
+}
+
+char *
+sc_asprintf(void *parent, const char *fmt, ...)
+{
+  va_list ap;
+  char *str;
+
+  va_start(ap, fmt);
+  str = sc_vasprintf(parent, fmt, ap);
+  va_end(ap);
+  return str;
+}
+
+char *
+sc_vasprintf(void *parent, const char *fmt, va_list ap)
+{
+  va_list apc;
+  ssize_t size = 0;
+  char *str = NULL;
+
+  va_copy(apc, ap);
+  size = vsnprintf(NULL, 0, fmt, apc);
+  va_end(apc);
+
+  if (size <= 0 || !(str = sc_newa(parent, char, size + 1)))
+    return NULL;
+
+  vsnprintf(str, size + 1, fmt, ap);
+  return str;
+}
+
+scSlice *
+sc_slice(void *parent, const void *buf, size_t offset, size_t len)
+{
+  chunk *src = GET_CHUNK(buf);
+  const char *data;
+  slice *slc;
+  chunk *chnk;
+
+  if (!src || IS_MAPPED(src))
+    return NULL;
+
+  /* Slices of slices refer to the original buffer */
+  if (src->flags & SC_FLAGS_SLICE) {
+    slc = (slice*) buf;
+    if (offset > slc->view.len || len > slc->view.len - offset)
+      return NULL;
+
+    data = slc->view.data + offset;
+    src = GET_CHUNK(slc->source);
+  } else {
+    if (offset > src->size || len > src->size - offset)
+      return NULL;
+
+    data = (const char*) buf + offset;
+  }
+
+  slc = (slice*) sc_calloc(parent, sizeof(slice), 1, "scSlice");
+  if (!slc)
+    return NULL;
+
+  /* Interned sources are shared across threads; take their lock */
+  chnk = GET_CHUNK(slc);
+  if (!_sc_incref(slc, GET_ALLOC(src), NULL)) {
+    sc_decref(parent, slc);
+    return NULL;
+  }
+
+  slc->view.data = data;
+  slc->view.len = len;
+  slc->source = (char*) GET_ALLOC(src);
+  chnk->flags |= SC_FLAGS_SLICE;
+  return &slc->view;
+}
+
+char *
+sc_slice_strdup(void *parent, const scSlice *view)
+{
+  char *tmp;
+
+  if (!view)
+    return NULL;
+
+  tmp = sc_newa(parent, char, view->len + 1);
+  if (tmp) {
+    memcpy(tmp, view->data, view->len);
+    tmp[view->len] = '\0';
+  }
+  return tmp;
+}
+
+const char *
+sc_intern(void *parent, const char *str)
+{
+  size_t len, hash, i;
+  chunk *chnk;
+  char *tmp;
+
+  if (!str)
+    return NULL;
+
+  len = strlen(str);
+  hash = intern_hash(str, len);
+
+  pthread_mutex_lock(&intern_lock);
+  if (interned.size > 0) {
+    i = intern_slot(str, len, hash);
+    if (interned.keys[i]) {
+      tmp = incref(GET_CHUNK(parent), interned.keys[i], true)
+            ? GET_ALLOC(interned.keys[i]) : NULL;
+      pthread_mutex_unlock(&intern_lock);
+      return tmp;
+    }
+  }
+
+  /* Other trees may come to share it, so it never uses parent's backend */
+  tmp = NULL;
+  chnk = _malloc(len + 1, NULL);
+  if (chnk) {
+    memcpy(PAYLOAD(chnk), str, len);
+    ((char*) PAYLOAD(chnk))[len] = '\0';
+    chnk->size = len + 1;
+    retag(chnk, "char");
+
+    if (!incref(GET_CHUNK(parent), chnk, true)) {
+      free(chnk->ext);
+      base_free(chnk);
+    } else if (!intern_put(chnk, hash)) {
+      unlink(GET_CHUNK(parent), chnk, true);
+    } else {
+      chnk->flags |= SC_FLAGS_INTERN;
+      tmp = GET_ALLOC(chnk);
+    }
+  }
+  pthread_mutex_unlock(&intern_lock);
+
+  return tmp;
+}
+
+size_t
+sc_intern_saved(void)
+{
+  size_t saved = 0, i;
+
+  pthread_mutex_lock(&intern_lock);
+  for (i = 0; i < interned.size; i++)
+    if (interned.keys[i] && interned.keys[i]->parents.used > 1)
+      saved += (interned.keys[i]->parents.used - 1)
+               * (sizeof(chunk) + interned.keys[i]->size);
+  pthread_mutex_unlock(&intern_lock);
+
+  return saved;
+}
+
+typedef struct {
+  const char *tag;
+  scRelocate *relocate;
+} relocator;
+
+static relocator *relocators;
+static size_t     nrelocators;
+
+static void
+slice_relocate(slice *dst, const slice *src, void *ctx)
+{
+  uintptr_t source = (uintptr_t) sc_relocate(ctx, src->source);
+
+  dst->view.data = (const char*) (source + (src->view.data - src->source));
+  dst->source = (char*) source;
+}
+
+static scRelocate *
+relocator_get(chunk *chnk)
+{
+  const char *tag = tag_get(chnk);
+  size_t i;
+
+  if (chnk->flags & SC_FLAGS_SLICE)
+    return (scRelocate*) slice_relocate;
+
+  if (!tag)
+    return NULL;
+
+  for (i = 0; i < nrelocators; i++)
+    if (relocators[i].tag == tag || !strcmp(relocators[i].tag, tag))
+      return relocators[i].relocate;
+
+  return NULL;
+}
+
+bool
+sc_relocator_set_tag(const char *tag, scRelocate *relocate)
+{
+  relocator *tmp;
+  size_t i;
+
+  if (!tag)
+    return false;
+
+  for (i = 0; i < nrelocators; i++) {
+    if (!strcmp(relocators[i].tag, tag)) {
+      relocators[i].relocate = relocate;
+      return true;
+    }
+  }
+
+  tmp = (relocator*) realloc(relocators, (i + 1) * sizeof(relocator));
+  if (!tmp)
+    return false;
+
+  relocators = tmp;
+  relocators[nrelocators].tag = tag;
+  relocators[nrelocators++].relocate = relocate;
+  return true;
+}
+
+/*
+ * Finds the index of a chunk of the subtree. The map is private to the
+ * walk, so several threads may walk (and clone) the same subtree at once.
+ */
+static bool
+reloc_find(reloc *rl, chunk *chnk, size_t *idx)
+{
+  return ptrmap_get(&rl->map, chnk, idx);
+}
+
+void *
+sc_relocate(void *ctx, const void *ptr)
+{
+  reloc *rl = (reloc*) ctx;
+  size_t i;
+
+  if (!rl || !ptr || !reloc_find(rl, GET_CHUNK(ptr), &i))
+    return rl && rl->copies ? (void*) ptr : NULL;
+
+  if (rl->copies)
+    return GET_ALLOC(rl->copies[i]);
+  return (void*) (uintptr_t) (rl->offsets[i] + sizeof(chunk));
+}
+
+static void
+reloc_free(reloc *rl)
+{
+  free(rl->map.keys);
+  free(rl->map.vals);
+  free(rl->order);
+  free(rl->offsets);
+  free(rl->copies);
+}
+
+static bool
+reloc_add(reloc *rl, chunk *chnk)
+{
+  size_t count = rl->count;
+
+  /* Grow the arrays at each power of two */
+  if (count > 0 && (count & (count - 1)) == 0) {
+    chunk **order = (chunk**) realloc(rl->order, count * 2 * sizeof(chunk*));
+    if (!order)
+      return false;
+    rl->order = order;
+  }
+
+  if (!ptrmap_put(&rl->map, chnk, count))
+    return false;
+
+  rl->order[rl->count++] = chnk;
+  return true;
+}
+
+/* Collects the subtree below root in breadth-first order */
+static size_t
+reloc_init(reloc *rl, chunk *root)
+{
+  size_t i, j, idx;
+
+  memset(rl, 0, sizeof(reloc));
+  rl->order = (chunk**) malloc(sizeof(chunk*));
+  if (!rl->order || !reloc_add(rl, root))
+    goto error;
+
+  for (i = 0; i < rl->count; i++) {
+    chunk *chnk = rl->order[i];
+
+    for (j = 0; j < chnk->children.used; j++) {
+      chunk *chld = link_get(chnk, &chnk->children, j);
+
+      if (!reloc_find(rl, chld, &idx) && !reloc_add(rl, chld))
+        goto error;
+    }
+  }
+
+  rl->offsets = (size_t*) malloc(rl->count * sizeof(size_t));
+  if (!rl->offsets)
+    goto error;
+  return rl->count;
+
+error:
+  reloc_free(rl);
+  return 0;
+}
+
+/* Lays out (and, given a buffer, writes) the image; returns its size */
+static size_t
+image_fill(reloc *rl, size_t count, char *buf)
+{
+  size_t size, i, j, k = 0;
+
+  size = ALIGN_UP(sizeof(image), IMAGE_ALIGN);
+  for (i = 0; i < count; i++) {
+    rl->offsets[i] = size;
+    size = ALIGN_UP(size + sizeof(chunk) + rl->order[i]->size, IMAGE_ALIGN);
+  }
+
+  for (i = 0; i < count; i++) {
+    chunk *src = rl->order[i];
+    chunk *dst = NULL;
+    int64_t *edges = NULL;
+    size_t off = rl->offsets[i];
+
+    /* Children are always part of the image */
+    if (buf) {
+      dst = (chunk*) (buf + off);
+      edges = (int64_t*) (buf + size);
+      memcpy(dst + 1, PAYLOAD(src), src->size);
+      dst->base = (void*) (intptr_t) -((int64_t) off);
+      dst->size = src->size;
+      dst->flags = SC_FLAGS_MAPPED;
+      dst->tagid = src->tagid;
+      dst->children.chunks = (chunk**) (intptr_t) (size - off);
+      dst->children.size = dst->children.used = src->children.used;
+      for (j = 0; j < src->children.used; j++) {
+        reloc_find(rl, src->children.chunks[j], &k);
+        edges[j] = rl->offsets[k] - off;
+      }
+    }
+    size += src->children.used * sizeof(int64_t);
+
+    /* Parents outside of the image are dropped */
+    if (buf)
+      edges = (int64_t*) (buf + size);
+    for (j = 0, k = 0; j < src->parents.used; j++) {
+      size_t idx;
+
+      if (!reloc_find(rl, src->parents.chunks[j], &idx))
+        continue;
+
+      if (buf)
+        edges[k] = rl->offsets[idx] - off;
+      k++;
+    }
+    if (buf) {
+      dst->parents.chunks = (chunk**) (intptr_t) (size - off);
+      dst->parents.size = dst->parents.used = k;
+    }
+    size += k * sizeof(int64_t);
+  }
+
+  /* Tags go last, keeping the edge arrays aligned */
+  for (i = 0; i < count; i++) {
+    chunk *src = rl->order[i];
+
+    if (!src->tag)
+      continue;
+
+    if (buf) {
+      strcpy(buf + size, src->tag);
+      ((chunk*) (buf + rl->offsets[i]))->tag =
+        (char*) (intptr_t) (size - rl->offsets[i]);
+    }
+    size += strlen(src->tag) + 1;
+  }
+
+  if (buf) {
+    image *img = (image*) buf;
+
+    memcpy(img->magic, IMAGE_MAGIC, sizeof(img->magic));
+    img->version = IMAGE_VERSION;
+    img->header = sizeof(chunk);
+    img->size = size;
+    img->root = rl->offsets[0];
+    img->count = count;
+
+    for (i = 0; i < count; i++) {
+      scRelocate *relocate = relocator_get(rl->order[i]);
+      if (relocate)
+        relocate(buf + rl->offsets[i] + sizeof(chunk),
+                 GET_ALLOC(rl->order[i]), rl);
+    }
+  }
+
+  return size;
+}
+
+/* Builds an image of the subtree below root in a new buffer */
+static char *
+image_build(chunk *root, size_t *size)
+{
+  reloc rl;
+  size_t count;
+  char *buf;
 
-  if (csnc->next)
-    csnc->next->prev = tail;
-  tail->next = csnc->next;
-  csnc->next = head;
-  head->prev = csnc;
+  count = reloc_init(&rl, root);
+  if (count == 0)
+    return NULL;
+
+  *size = image_fill(&rl, count, NULL);
+  buf = (char*) calloc(1, *size);
+  if (buf)
+    image_fill(&rl, count, buf);
+
+  reloc_free(&rl);
+  return buf;
 }
 
-size_t
-sc_size(void *mem)
+/* Whether off is where one of the image's chunks starts */
+static bool
+image_has(const uint64_t *offs, size_t count, int64_t off)
 {
-  chunk *chnk = GET_CHUNK(mem);
-  if (chnk)
-    return chnk->size;
-  return 0;
+  size_t lo = 0, hi = count;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if ((int64_t) offs[mid] == off)
+      return true;
+    if ((int64_t) offs[mid] < off)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return false;
 }
 
+/* Whether an edge array of the chunk at off stays inside the image */
+static bool
+image_link(const char *addr, uint64_t size, uint64_t off, const link *lnk,
+           const uint64_t *offs, size_t count)
+{
+  int64_t rel = (int64_t) (intptr_t) lnk->chunks;
+  const int64_t *edges;
+  uint64_t start;
+  size_t i;
+
+  if (lnk->used != lnk->size || lnk->borrowed)
+    return false;
 
-size_t
-sc_size_parents_tag(void *mem, const char *tag)
+  if (rel < -(int64_t) off || (uint64_t) ((int64_t) off + rel) > size)
+    return false;
+
+  start = off + rel;
+  if (start % sizeof(int64_t) != 0
+      || lnk->used > (size - start) / sizeof(int64_t))
+    return false;
+
+  edges = (const int64_t*) (addr + start);
+  for (i = 0; i < lnk->used; i++)
+    if (edges[i] < -(int64_t) off
+        || !image_has(offs, count, (int64_t) off + edges[i]))
+      return false;
+
+  return true;
+}
+
+/*
+ * Checks that every chunk, edge and tag of an image lies inside it, so
+ * that a damaged file can't send readers elsewhere. Chunks are laid out
+ * one after another from the header; edges must point at their starts.
+ */
+static bool
+image_valid(const char *addr, const image *img)
 {
-  chunk *chnk = GET_CHUNK(mem);
-  if (!chnk)
-    return 0;
+  uint64_t off = ALIGN_UP(sizeof(image), IMAGE_ALIGN), *offs;
+  size_t count = img->count, i;
+  bool ok = false;
 
-  if (!tag)
-    return chnk->parents.used;
+  if (count == 0 || count > img->size / sizeof(chunk))
+    return false;
 
-  size_t i, count;
-  for (i=0, count=0; i < chnk->parents.used; i++)
-    if (!strcmp(chnk->parents.chunks[i]->tag, tag))
-      count++;
+  offs = (uint64_t*) malloc(count * sizeof(uint64_t));
+  if (!offs)
+    return false;
 
-  return count;
+  for (i = 0; i < count; i++) {
+    const chunk *chnk = (const chunk*) (addr + off);
+
+    if (off > img->size - sizeof(chunk)
+        || chnk->size > img->size - off - sizeof(chunk))
+      goto out;
+
+    offs[i] = off;
+    off = ALIGN_UP(off + sizeof(chunk) + chnk->size, IMAGE_ALIGN);
+  }
+
+  if (img->root != offs[0])
+    goto out;
+
+  for (i = 0; i < count; i++) {
+    const chunk *chnk = (const chunk*) (addr + offs[i]);
+    int64_t tag = (int64_t) (intptr_t) chnk->tag;
+
+    if ((intptr_t) chnk->base != -(intptr_t) offs[i]
+        || chnk->flags != SC_FLAGS_MAPPED || chnk->ext || chnk->destructor
+        || chnk->prev || chnk->next
+        || !image_link(addr, img->size, offs[i], &chnk->children, offs, count)
+        || !image_link(addr, img->size, offs[i], &chnk->parents, offs, count))
+      goto out;
+
+    if (tag != 0 && (tag < 0 || (uint64_t) tag >= img->size - offs[i]
+                     || !memchr(addr + offs[i] + tag, '\0',
+                                img->size - offs[i] - tag)))
+      goto out;
+  }
+
+  ok = true;
+
+out:
+  free(offs);
+  return ok;
 }
 
-size_t
-sc_size_children_tag(void *mem, const char *tag)
+/* Validates an image, returning its root */
+static chunk *
+image_root(const void *addr, size_t size)
 {
-  chunk *chnk = GET_CHUNK(mem);
-  if (!chnk)
-    return 0;
+  const image *img = (const image*) addr;
 
-  if (!tag)
-    return chnk->children.used;
+  if (size < sizeof(image) || memcmp(img->magic, IMAGE_MAGIC, 8) != 0
+      || img->version != IMAGE_VERSION || img->header != sizeof(chunk)
+      || img->size != size || !image_valid((const char*) addr, img)) {
+    errno = EINVAL;
+    return NULL;
+  }
 
-  size_t i, count;
-  for (i=0, count=0; i < chnk->children.used; i++)
-    if (!strcmp(chnk->children.chunks[i]->tag, tag))
-      count++;
+  return (chunk*) (((char*) addr) + img->root);
+}
 
-  return count;
+/*
+ * The control segment of a shared hierarchy. Each published version lives
+ * in its own segment, named after the control segment and the version.
+ */
+typedef struct {
+  char     magic[8];
+  uint64_t version;
+} shmctl;
+
+typedef struct {
+  void   *addr;
+  size_t  size;
+  chunk  *root;
+  shmctl *ctl;      /* Only for shared hierarchies */
+  uint64_t version;
+} snapshot;
+
+static void
+snapshot_free(snapshot *snap)
+{
+  if (snap->addr)
+    munmap(snap->addr, snap->size);
+  if (snap->ctl)
+    munmap(snap->ctl, sizeof(shmctl));
 }
 
 bool
-sc_tag_set(void *mem, const char *fmt, ...)
+sc_snapshot_write(void *root, const char *path)
 {
-  va_list ap;
-  chunk *chnk;
-  char *tmp;
+  chunk *chnk = GET_CHUNK(root);
+  size_t size, done;
+  char *buf;
+  FILE *file;
 
-  chnk = GET_CHUNK(mem);
-  if (!chnk || !fmt)
+  if (!chnk || IS_MAPPED(chnk) || !path)
     return false;
 
-  va_start(ap, fmt);
-  tmp = sc_vasprintf(mem, fmt, ap);
-  va_end(ap);
-  if (!tmp)
+  buf = image_build(chnk, &size);
+  if (!buf)
     return false;
 
-  if (chnk->tag && chnk->flags & SC_FLAGS_TAG_ALLOCATED)
-    sc_decref(mem, chnk->tag);
+  file = fopen(path, "wb");
+  if (!file) {
+    free(buf);
+    return false;
+  }
 
-  chnk->tag = tmp;
-  chnk->flags |= SC_FLAGS_TAG_ALLOCATED;
+  done = fwrite(buf, 1, size, file);
+  free(buf);
+  if (fclose(file) != 0 || done < size)
+    return false;
   return true;
 }
 
-bool
-sc_tag_set_const(void *mem, const char *tag)
+void *
+sc_snapshot_map(void *parent, const char *path)
 {
-  chunk *chnk = GET_CHUNK(mem);
-  if (!chnk)
-    return false;
+  snapshot *snap;
+  struct stat st;
+  void *addr;
+  FILE *file;
 
-  if (chnk->tag && chnk->flags & SC_FLAGS_TAG_ALLOCATED)
-    sc_decref(mem, chnk->tag);
+  if (!path)
+    return NULL;
 
-  chnk->tag = (char*) tag;
-  chnk->flags &= ~SC_FLAGS_TAG_ALLOCATED;
-  return true;
+  file = fopen(path, "rb");
+  if (!file)
+    return NULL;
+
+  if (fstat(fileno(file), &st) != 0 || st.st_size < (off_t) sizeof(image)) {
+    fclose(file);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+  fclose(file);
+  if (addr == MAP_FAILED)
+    return NULL;
+
+  snap = sc_new0(parent, snapshot);
+  if (!snap) {
+    munmap(addr, st.st_size);
+    return NULL;
+  }
+
+  retag(GET_CHUNK(snap), "scSnapshot");
+  sc_destructor_set(snap, snapshot_free);
+  snap->addr = addr;
+  snap->size = st.st_size;
+  snap->root = image_root(addr, st.st_size);
+  if (!snap->root) {
+    sc_decref(parent, snap);
+    return NULL;
+  }
+
+  return snap;
 }
 
-const char *
-sc_tag_get(void *mem)
+void *
+sc_snapshot_root(void *snap)
+{
+  if (!sc_ensure_tag(snap, "scSnapshot"))
+    return NULL;
+  return GET_ALLOC(((snapshot*) snap)->root);
+}
+
+void *
+sc_snapshot_ptr(const void *mem, const void *ref)
 {
   chunk *chnk = GET_CHUNK(mem);
-  return chnk ? chnk->tag : NULL;
+
+  if (!ref || !IS_MAPPED(chnk))
+    return (void*) ref;
+
+  return ((char*) RELATIVE(chnk, chnk->base)) + (uintptr_t) ref;
 }
 
-char *
-sc_strdup(void *parent, const char *str)
+static int
+shm_segment(const char *name, uint64_t version, int flags)
 {
-  if (!str)
+  char seg[strlen(name) + 22];
+
+  snprintf(seg, sizeof(seg), "%s.%llu", name, (unsigned long long) version);
+  if (flags < 0)
+    return shm_unlink(seg);
+  return shm_open(seg, flags, 0644);
+}
+
+/* Maps (and when writing, creates) the control segment */
+static shmctl *
+shm_control(const char *name, bool writable)
+{
+  shmctl *ctl = MAP_FAILED;
+  struct stat st;
+  int fd;
+
+  fd = shm_open(name, writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+  if (fd < 0)
     return NULL;
-  return sc_strndup(parent, str, strlen(str));
+
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return NULL;
+  }
+
+  if (st.st_size < (off_t) sizeof(shmctl)) {
+    if (!writable)
+      errno = ENOENT;
+    else if (ftruncate(fd, sizeof(shmctl)) == 0)
+      st.st_size = sizeof(shmctl);
+  }
+
+  if (st.st_size >= (off_t) sizeof(shmctl))
+    ctl = (shmctl*) mmap(NULL, sizeof(shmctl),
+                         writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                         MAP_SHARED, fd, 0);
+  close(fd);
+  if (ctl == MAP_FAILED)
+    return NULL;
+
+  if (writable && ctl->version == 0)
+    memcpy(ctl->magic, SHM_MAGIC, sizeof(ctl->magic));
+
+  if (memcmp(ctl->magic, SHM_MAGIC, sizeof(ctl->magic)) != 0) {
+    munmap(ctl, sizeof(shmctl));
+    errno = EINVAL;
+    return NULL;
+  }
+
+  return ctl;
 }
 
-char *
-sc_strndup(void *parent, const char *str, size_t len)
+bool
+sc_shm_publish(void *root, const char *name)
 {
-  char *tmp;
+  chunk *chnk = GET_CHUNK(root);
+  void *addr = MAP_FAILED;
+  uint64_t version;
+  size_t size, count;
+  shmctl *ctl;
+  reloc rl;
+  int fd;
+
+  if (!chnk || IS_MAPPED(chnk) || !name)
+    return false;
 
-  if (!str)
+  count = reloc_init(&rl, chnk);
+  if (count == 0)
+    return false;
+
+  ctl = shm_control(name, true);
+  if (!ctl) {
+    reloc_free(&rl);
+    return false;
+  }
+
+  /* The image is built directly in the new segment */
+  size = image_fill(&rl, count, NULL);
+  version = __atomic_load_n(&ctl->version, __ATOMIC_ACQUIRE) + 1;
+  fd = shm_segment(name, version, O_RDWR | O_CREAT | O_TRUNC);
+  if (fd >= 0) {
+    if (ftruncate(fd, size) == 0)
+      addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+  }
+
+  if (addr == MAP_FAILED) {
+    if (fd >= 0)
+      shm_segment(name, version, -1);
+    munmap(ctl, sizeof(shmctl));
+    reloc_free(&rl);
+    return false;
+  }
+
+  image_fill(&rl, count, (char*) addr);
+  munmap(addr, size);
+  reloc_free(&rl);
+
+  /* Readers that mapped the old version keep it until they unmap it */
+  __atomic_store_n(&ctl->version, version, __ATOMIC_RELEASE);
+  if (version > 1)
+    shm_segment(name, version - 1, -1);
+
+  munmap(ctl, sizeof(shmctl));
+  return true;
+}
+
+void *
+sc_shm_map(void *parent, const char *name)
+{
+  snapshot *snap;
+  struct stat st;
+  int fd;
+
+  if (!name)
     return NULL;
 
-  tmp = sc_newa(parent, char, len + 1);
-  if (tmp) {
-    strncpy(tmp, str, len);
-    tmp[len] = '\0';
+  snap = sc_new0(parent, snapshot);
+  if (!snap)
+    return NULL;
+
+  retag(GET_CHUNK(snap), "scSnapshot");
+  sc_destructor_set(snap, snapshot_free);
+  snap->ctl = shm_control(name, false);
+  if (!snap->ctl)
+    goto error;
+
+  /* Retry if a new version is published while we open the segment */
+  do {
+    snap->version = __atomic_load_n(&snap->ctl->version, __ATOMIC_ACQUIRE);
+    if (snap->version == 0) {
+      errno = ENOENT;
+      goto error;
+    }
+
+    fd = shm_segment(name, snap->version, O_RDONLY);
+  } while (fd < 0 && errno == ENOENT
+           && snap->version != __atomic_load_n(&snap->ctl->version,
+                                               __ATOMIC_ACQUIRE));
+  if (fd < 0)
+    goto error;
+
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(image)) {
+    close(fd);
+    errno = EINVAL;
+    goto error;
   }
-  return tmp;
+
+  snap->addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (snap->addr == MAP_FAILED) {
+    snap->addr = NULL;
+    goto error;
+  }
+
+  snap->size = st.st_size;
+  snap->root = image_root(snap->addr, snap->size);
+  if (!snap->root)
+    goto error;
+
+  return snap;
+
+error:
+  sc_decref(parent, snap);
+  return NULL;
 }
 
-char *
-sc_asprintf(void *parent, const char *fmt, ...)
+bool
+sc_shm_current(void *snap)
 {
-  va_list ap;
-  char *str;
+  snapshot *tmp = (snapshot*) sc_ensure_tag(snap, "scSnapshot");
 
-  va_start(ap, fmt);
-  str = sc_vasprintf(parent, fmt, ap);
-  va_end(ap);
-  return str;
+  if (!tmp || !tmp->ctl)
+    return false;
+
+  return tmp->version == __atomic_load_n(&tmp->ctl->version, __ATOMIC_ACQUIRE);
 }
 
-char *
-sc_vasprintf(void *parent, const char *fmt, va_list ap)
+bool
+sc_shm_remove(const char *name)
 {
-  va_list apc;
-  ssize_t size = 0;
-  char *str = NULL;
+  shmctl *ctl;
 
-  va_copy(apc, ap);
-  size = vsnprintf(NULL, 0, fmt, apc);
-  va_end(apc);
+  if (!name)
+    return false;
 
-  if (size <= 0 || !(str = sc_newa(parent, char, size + 1)))
+  ctl = shm_control(name, false);
+  if (ctl) {
+    if (ctl->version > 0)
+      shm_segment(name, ctl->version, -1);
+    munmap(ctl, sizeof(shmctl));
+  }
+
+  return shm_unlink(name) == 0;
+}
+
+void *
+sc_clone(void *parent, void *mem)
+{
+  chunk *prnt = GET_CHUNK(parent);
+  chunk *root = GET_CHUNK(mem);
+  const scAllocator *be = backend(prnt);
+  size_t count, size, edges, bytes = 0, i, j, k, idx;
+  bool *seen = NULL;
+  char *buf = NULL;
+  reloc rl;
+
+  if (!root || IS_MAPPED(prnt))
     return NULL;
 
-  vsnprintf(str, size + 1, fmt, ap);
-  return str;
+  count = reloc_init(&rl, root);
+  if (count == 0)
+    return NULL;
+
+  rl.copies = (chunk**) calloc(count, sizeof(chunk*));
+  seen = (bool*) calloc(count, sizeof(bool));
+  if (!rl.copies || !seen)
+    goto error;
+
+  /* Lay out the slab: chunks, edge arrays, then tags of mapped chunks */
+  size = ALIGN_UP(sizeof(slab), IMAGE_ALIGN);
+  for (i = 0; i < count; i++) {
+    bytes += rl.order[i]->size;
+    rl.offsets[i] = 0;
+    if (alignment(rl.order[i]) > 0)
+      continue;
+
+    rl.offsets[i] = size;
+    size = ALIGN_UP(size + sizeof(chunk) + rl.order[i]->size, IMAGE_ALIGN);
+  }
+
+  edges = size;
+  for (i = 0; i < count; i++) {
+    chunk *src = rl.order[i];
+
+    size += LINK_BYTES(src->children.used);
+    for (j = 0, k = 0; j < src->parents.used; j++)
+      if (reloc_find(&rl, link_get(src, &src->parents, j), &idx))
+        k++;
+    size += LINK_BYTES(k);
+
+    if (IS_MAPPED(src) && src->tag)
+      size += strlen(tag_get(src)) + 1;
+  }
+
+  buf = (char*) mem_alloc(be, size);
+  if (!buf)
+    goto error;
+  ((slab*) buf)->live = 0;
+  ((slab*) buf)->size = size;
+  ((slab*) buf)->backend = be;
+
+  /* Copy the chunks; aligned ones get their own allocation */
+  for (i = 0; i < count; i++) {
+    chunk *src = rl.order[i];
+    chunk *dst;
+
+    if (rl.offsets[i] == 0) {
+      dst = _memalign(src->size, alignment(src), be);
+      if (!dst)
+        goto error;
+    } else {
+      dst = (chunk*) (buf + rl.offsets[i]);
+      memset(dst, 0, sizeof(chunk));
+      dst->base = buf;
+      dst->flags = SC_FLAGS_SLAB | (be ? SC_FLAGS_BACKEND : 0);
+      ((slab*) buf)->live++;
+    }
+
+    memcpy(PAYLOAD(dst), PAYLOAD(src), src->size);
+    dst->size = src->size;
+    dst->flags |= src->flags & (SC_FLAGS_TAG_ALLOCATED | SC_FLAGS_SLICE);
+    dst->tagid = IS_MAPPED(src) ? tag_hash(tag_get(src)) : src->tagid;
+    if (src->destructor != (scFree*) snapshot_free)
+      dst->destructor = src->destructor;
+    rl.copies[i] = dst;
+  }
+
+  /* Copy the edges within the subtree, in slab-borrowed arrays */
+  size = edges;
+  for (i = 0; i < count; i++) {
+    chunk *src = rl.order[i];
+    chunk *dst = rl.copies[i];
+
+    dst->children.chunks = (chunk**) (buf + size);
+    dst->children.size = src->children.used;
+    for (j = 0; j < src->children.used; j++) {
+      reloc_find(&rl, link_get(src, &src->children, j), &k);
+      LINK_IDS(&dst->children)[j] = rl.copies[k]->tagid;
+      dst->children.chunks[dst->children.used++] = rl.copies[k];
+    }
+    size += LINK_BYTES(dst->children.used);
+
+    for (j = 0, k = 0; j < src->parents.used; j++)
+      if (reloc_find(&rl, link_get(src, &src->parents, j), &idx))
+        k++;
+    dst->parents.chunks = (chunk**) (buf + size);
+    dst->parents.size = k;
+    for (j = 0; j < src->parents.used; j++) {
+      if (reloc_find(&rl, link_get(src, &src->parents, j), &k)) {
+        LINK_IDS(&dst->parents)[dst->parents.used] = rl.copies[k]->tagid;
+        dst->parents.chunks[dst->parents.used++] = rl.copies[k];
+      }
+    }
+    size += LINK_BYTES(dst->parents.used);
+
+    dst->children.borrowed = dst->children.used > 0;
+    dst->parents.borrowed = dst->parents.used > 0;
+    if (dst->children.used == 0)
+      dst->children.chunks = NULL;
+    if (dst->parents.used == 0)
+      dst->parents.chunks = NULL;
+  }
+
+  /* Aligned copies may outlive every chunk of the slab; keep no arrays there */
+  for (i = 0; i < count; i++)
+    if (rl.offsets[i] == 0 && (!own(rl.copies[i], &rl.copies[i]->children)
+                               || !own(rl.copies[i], &rl.copies[i]->parents)))
+      goto error;
+
+  /* Allocated tags are children, the strings of mapped ones are copied */
+  for (i = 0; i < count; i++) {
+    chunk *src = rl.order[i];
+    chunk *dst = rl.copies[i];
+
+    if (IS_MAPPED(src) && src->tag) {
+      dst->tag = strcpy(buf + size, tag_get(src));
+      size += strlen(dst->tag) + 1;
+    } else if (src->flags & SC_FLAGS_TAG_ALLOCATED
+               && reloc_find(&rl, GET_CHUNK(src->tag), &k))
+      dst->tag = (char*) GET_ALLOC(rl.copies[k]);
+    else {
+      dst->tag = src->tag;
+      dst->flags &= ~SC_FLAGS_TAG_ALLOCATED;
+    }
+  }
+
+  /* Rebuild the groups, skipping cousins outside of the subtree */
+  for (i = 0; i < count; i++) {
+    chunk *tmp = rl.order[i];
+    chunk *last = NULL;
+
+    if (seen[i] || IS_MAPPED(tmp) || (!tmp->prev && !tmp->next))
+      continue;
+
+    while (tmp->prev)
+      tmp = tmp->prev;
+
+    for (; tmp; tmp = tmp->next) {
+      if (!reloc_find(&rl, tmp, &k))
+        continue;
+
+      seen[k] = true;
+      if (last) {
+        last->next = rl.copies[k];
+        rl.copies[k]->prev = last;
+      }
+      last = rl.copies[k];
+    }
+  }
+
+  if (prnt && prnt->flags & SC_FLAGS_ACCOUNT && !budget(prnt, bytes))
+    goto error;
+  if (!incref(prnt, rl.copies[0], false))
+    goto error;
+
+  for (i = 0; i < count; i++) {
+    scRelocate *relocate = relocator_get(rl.order[i]);
+    if (relocate)
+      relocate(GET_ALLOC(rl.copies[i]), GET_ALLOC(rl.order[i]), &rl);
+  }
+
+  mem = GET_ALLOC(rl.copies[0]);
+  if (((slab*) buf)->live == 0)
+    mem_free(be, buf, ((slab*) buf)->size);
+  reloc_free(&rl);
+  free(seen);
+  return mem;
+
+error:
+  for (i = 0; rl.copies && i < count; i++) {
+    if (rl.copies[i] && rl.offsets[i] == 0) {
+      link_free(rl.copies[i], &rl.copies[i]->children);
+      link_free(rl.copies[i], &rl.copies[i]->parents);
+      base_free(rl.copies[i]);
+    }
+  }
+  if (buf)
+    mem_free(be, buf, ((slab*) buf)->size);
+  reloc_free(&rl);
+  free(seen);
+  return NULL;
 }
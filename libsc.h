@@ -36,6 +36,36 @@ extern "C"
 typedef void
 scFree(void *);
 
+typedef bool
+scBudget(void *mem, size_t used, size_t request, void *misc);
+
+typedef void
+scRelocate(void *dst, const void *src, void *ctx);
+
+typedef bool
+scPrune(void *child, void *arg);
+
+typedef struct {
+  size_t hits;      /* Calls to sc_cache_touch() */
+  size_t misses;    /* Entries added to the cache */
+  size_t evictions; /* Entries reclaimed by the cache */
+  size_t entries;
+  size_t bytes;
+} scCacheStats;
+
+typedef struct {
+  const char *data;
+  size_t len;
+} scSlice;
+
+typedef struct {
+  void *(*alloc)(void *ctx, size_t size);
+  void *(*memalign)(void *ctx, size_t align, size_t size);      /* Optional */
+  void *(*realloc)(void *ctx, void *ptr, size_t old, size_t size); /* Opt. */
+  void  (*free)(void *ctx, void *ptr, size_t size);
+  void   *ctx;
+} scAllocator;
+
 #define sc_new(p, t)             ((t*) sc_calloc(p, sizeof(t), 1, __str(t)))
 #define sc_new0(p, t)            ((t*) sc_calloc0(p, sizeof(t), 1, __str(t)))
 #define sc_newa(p, t, c)         ((t*) sc_calloc(p, sizeof(t), c, __str(t)))
@@ -62,6 +92,9 @@ scFree(void *);
 #define sc_size_children_type(m, t) sc_size_children_tag(m, __str(t))
 #define sc_destructor_set(m, d)     _sc_destructor_set(m, (scFree*) d)
 #define sc_ensure(m, t)             ((t*) sc_ensure_tag(m, __str(t)))
+#define sc_budget_set(m, l, c, a)   _sc_budget_set(m, l, (scBudget*) c, a)
+#define sc_relocator_set_type(t, r) \
+  sc_relocator_set_tag(__str(t), (scRelocate*) r)
 
 void *
 _sc_alloc(void *parent, size_t size, size_t count, size_t align,
@@ -83,6 +116,29 @@ _sc_incref(void *parent, void *child, const char *location);
 void
 _sc_decref(void *parent, void *child, const char *location);
 
+/*
+ * Like sc_decref(), but a subtree freed by it is torn down by up to threads
+ * threads (zero for one per CPU). Destructors of different groups may run
+ * concurrently and must not modify chunks outside their own group; all of
+ * them have run before any memory of the subtree is freed.
+ */
+void
+sc_decref_parallel(void *parent, void *child, size_t threads);
+
+/*
+ * Like calling sc_decref(parent, children[i]) for each of the n children,
+ * but in time linear in n and the number of parent's children.
+ */
+void
+sc_decref_many(void *parent, void **children, size_t n);
+
+/*
+ * Drops each of parent's child references for which fn(child, arg) returns
+ * true, as sc_decref_many() would.
+ */
+void
+sc_prune(void *parent, scPrune *fn, void *arg);
+
 void *
 _sc_steal(void *parent, void *child, void *pold, const char *location);
 
@@ -98,6 +154,95 @@ sc_group(void *cousin, void *mem);
 size_t
 sc_size(void *mem);
 
+/*
+ * Retained sizes are only tracked below a chunk passed to sc_account() (or
+ * given a budget); everything allocated or linked beneath it inherits the
+ * accounting. Each chunk is charged to exactly one of its parents, its owner.
+ * A chunk with several parents stays charged to the first accounted parent
+ * it was linked to; when that edge is dropped the charge moves to one of the
+ * remaining parents. Chunks kept alive only by their group are uncharged.
+ */
+bool
+sc_account(void *mem);
+
+size_t
+sc_size_retained(void *mem);
+
+size_t
+sc_size_retained_chunks(void *mem);
+
+/*
+ * Limits the bytes retained below mem. When an allocation, resize or new
+ * edge would exceed the limit, the callback (if any) decides whether it may
+ * proceed; without a callback the operation fails with ENOMEM.
+ */
+bool
+_sc_budget_set(void *mem, size_t limit, scBudget *cb, void *misc);
+
+/*
+ * Creates an empty context whose memory, and that of everything allocated
+ * below it, comes from backend instead of the C library. Sizes passed to
+ * free and realloc are those of the original requests. Without memalign,
+ * aligned allocations fail; without realloc, it is emulated. The backend
+ * must outlive every chunk allocated from it. Interned strings, which other
+ * trees may share, always come from the C library.
+ */
+void *
+sc_context_new(void *parent, const scAllocator *backend);
+
+/*
+ * A cache is an accounted context whose direct children are kept in LRU
+ * order. Whenever a limit (zero for none) would be exceeded, the least
+ * recently used children with no other parents are released.
+ */
+void *
+sc_cache_new(void *parent, size_t bytes, size_t entries);
+
+bool
+sc_cache_limits_set(void *cache, size_t bytes, size_t entries);
+
+bool
+sc_cache_touch(void *mem);
+
+bool
+sc_cache_stats(void *cache, scCacheStats *stats);
+
+/*
+ * A weak handle refers to mem without keeping it alive. Once mem is
+ * destroyed, sc_weak_get() returns NULL. The handle itself is an ordinary
+ * chunk owned by parent, but it can't be resized.
+ */
+void *
+sc_weak_new(void *parent, void *mem);
+
+void *
+sc_weak_get(void *weak);
+
+/*
+ * A slice is a view of len bytes at offset within buf, which it keeps alive
+ * with a reference instead of copying. Slicing a slice views the same
+ * buffer. Resizing the buffer moves its slices along and truncates them if
+ * it shrinks. The bytes are not NUL terminated; sc_slice_strdup() makes a
+ * terminated copy.
+ */
+scSlice *
+sc_slice(void *parent, const void *buf, size_t offset, size_t len);
+
+char *
+sc_slice_strdup(void *parent, const scSlice *view);
+
+/*
+ * Returns a shared, immutable copy of str, giving parent a new reference
+ * to it. Identical strings interned anywhere in the process share a chunk,
+ * which leaves the table when its last reference is dropped. The saved
+ * bytes are those (header included) that separate copies would have used.
+ */
+const char *
+sc_intern(void *parent, const char *str);
+
+size_t
+sc_intern_saved(void);
+
 size_t
 sc_size_parents_tag(void *mem, const char *tag);
 
@@ -125,6 +270,69 @@ sc_asprintf(void *parent, const char *fmt, ...);
 char *
 sc_vasprintf(void *parent, const char *fmt, va_list ap);
 
+/*
+ * Copies the subtree below mem under parent: payloads, tags, destructors,
+ * groups and the edges between chunks of the subtree. The copies share a
+ * single allocation, which is released once all of them have been.
+ * Relocators (see below) are run on each copy; there sc_relocate() maps
+ * pointers into the subtree to their copies and leaves others unchanged.
+ */
+void *
+sc_clone(void *parent, void *mem);
+
+/*
+ * Snapshots serialize the subtree below root into a file that
+ * sc_snapshot_map() maps back read-only, without copying. The mapped
+ * hierarchy supports sc_size(), the tag and child/parent queries; every
+ * operation that would modify it fails. Edges to parents outside of the
+ * subtree are not saved, and payloads are only aligned to 16 bytes.
+ * Mapping checks that every chunk, edge and tag lies inside the file
+ * (failing with EINVAL otherwise), but payloads are trusted as written.
+ *
+ * Pointers stored in payloads are copied as-is unless a relocator is
+ * registered for the chunk's tag. A relocator receives the copy and the
+ * original, and should replace each pointer in the copy with the result
+ * of sc_relocate(ctx, ptr) (NULL for pointers outside of the subtree).
+ * Readers then resolve these fields with sc_snapshot_ptr(mem, field),
+ * which also works on the original, unmapped hierarchy.
+ */
+bool
+sc_relocator_set_tag(const char *tag, scRelocate *relocate);
+
+void *
+sc_relocate(void *ctx, const void *ptr);
+
+bool
+sc_snapshot_write(void *root, const char *path);
+
+void *
+sc_snapshot_map(void *parent, const char *path);
+
+void *
+sc_snapshot_root(void *snap);
+
+void *
+sc_snapshot_ptr(const void *mem, const void *ref);
+
+/*
+ * Shared hierarchies are snapshots published in POSIX shared memory under
+ * name (which should begin with a '/'). Each sc_shm_publish() creates a new
+ * version; readers that mapped an older one keep using it until they
+ * release the handle, and can check for updates with sc_shm_current().
+ * Only one process should publish under a given name.
+ */
+bool
+sc_shm_publish(void *root, const char *name);
+
+void *
+sc_shm_map(void *parent, const char *name);
+
+bool
+sc_shm_current(void *snap);
+
+bool
+sc_shm_remove(const char *name);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif /* __cplusplus */
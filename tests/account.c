@@ -0,0 +1,115 @@
+/*
+ * libsc - Relational memory management
+ *
+ * Copyright 2011 Nathaniel McCallum <nathaniel@themccallums.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include <errno.h>
+
+static size_t calls = 0;
+
+static bool
+over(void *mem, size_t used, size_t request, void *misc)
+{
+  calls++;
+  return misc != NULL;
+}
+
+int
+main(int argc, const char **argv)
+{
+  myStruct *top, *a, *b, *tmp;
+  char *str;
+
+  /* Test retained sizes of an existing tree */
+  assert(top = sc_new(NULL, myStruct));
+  assert(a = sc_new(top, myStruct));
+  assert(sc_size_retained(top) == sizeof(myStruct));
+  assert(sc_size_retained_chunks(top) == 1);
+  assert(sc_account(top));
+  assert(sc_size_retained(top) == 2 * sizeof(myStruct));
+  assert(sc_size_retained_chunks(top) == 2);
+
+  /* Test that new allocations and resizes are tracked */
+  assert(str = sc_strdup(a, "hello"));
+  assert(sc_size_retained(a) == sizeof(myStruct) + 6);
+  assert(sc_size_retained(top) == 2 * sizeof(myStruct) + 6);
+  assert(sc_size_retained_chunks(top) == 3);
+  assert(sc_resizea(&str, 16));
+  assert(sc_size_retained(top) == 2 * sizeof(myStruct) + 16);
+  sc_decref(a, str);
+  assert(sc_size_retained(top) == 2 * sizeof(myStruct));
+  assert(sc_size_retained_chunks(top) == 2);
+
+  /* Test that shared chunks are charged to a single owner */
+  assert(b = sc_new(top, myStruct));
+  assert(tmp = sc_newa(a, myStruct, 4));
+  assert(sc_incref(b, tmp));
+  assert(sc_size_retained(a) == 5 * sizeof(myStruct));
+  assert(sc_size_retained(b) == sizeof(myStruct));
+  assert(sc_size_retained(top) == 7 * sizeof(myStruct));
+  sc_decref(a, tmp);
+  assert(sc_size_retained(a) == sizeof(myStruct));
+  assert(sc_size_retained(b) == 5 * sizeof(myStruct));
+  assert(sc_size_retained(top) == 7 * sizeof(myStruct));
+  sc_decref(b, tmp);
+  assert(sc_size_retained(top) == 3 * sizeof(myStruct));
+  assert(sc_size_retained_chunks(top) == 3);
+
+  /* Test that budgets fail fast */
+  assert(sc_budget_set(a, 2 * sizeof(myStruct), NULL, NULL));
+  assert(tmp = sc_new(a, myStruct));
+  errno = 0;
+  assert(!sc_new(a, myStruct));
+  assert(errno == ENOMEM);
+  assert(!sc_resizea(&tmp, 2));
+  assert(sc_size_retained(top) == 4 * sizeof(myStruct));
+
+  /* Test that budgets of ancestors apply */
+  assert(sc_budget_set(top, 4 * sizeof(myStruct), NULL, NULL));
+  assert(!sc_new(b, myStruct));
+
+  /* Test that the budget callback is consulted */
+  assert(sc_budget_set(top, 4 * sizeof(myStruct), over, NULL));
+  assert(!sc_new(b, myStruct));
+  assert(calls == 1);
+  assert(sc_budget_set(top, 4 * sizeof(myStruct), over, top));
+  assert(tmp = sc_new(b, myStruct));
+  assert(calls == 2);
+  assert(sc_size_retained(top) == 5 * sizeof(myStruct));
+
+  /* Test that linking an existing subtree is charged */
+  assert(sc_budget_set(top, 0, NULL, NULL));
+  assert(tmp = sc_newa(NULL, myStruct, 3));
+  assert(sc_steal(b, tmp));
+  assert(sc_size_retained(b) == 5 * sizeof(myStruct));
+  assert(sc_size_retained(top) == 8 * sizeof(myStruct));
+  assert(sc_size_retained_chunks(top) == 6);
+
+  /* Test that a steal refused by the budget leaves the chunk in place */
+  assert(sc_budget_set(b, 6 * sizeof(myStruct), NULL, NULL));
+  assert(tmp = sc_newa(top, myStruct, 3));
+  assert(!sc_steal_old(b, tmp, top));
+  assert(sc_size_parents(tmp) == 1);
+  assert(sc_size_retained(b) == 5 * sizeof(myStruct));
+  assert(sc_size_retained(top) == 11 * sizeof(myStruct));
+  sc_decref(top, tmp);
+  assert(sc_size_retained(top) == 8 * sizeof(myStruct));
+
+  sc_decref(NULL, top);
+  return 0;
+}
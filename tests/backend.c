@@ -0,0 +1,136 @@
+/*
+ * libsc - Relational memory management
+ *
+ * Copyright 2011 Nathaniel McCallum <nathaniel@themccallums.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "common.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  size_t blocks;
+  size_t bytes;
+} counter;
+
+static void *
+count_alloc(void *ctx, size_t size)
+{
+  counter *c = ctx;
+  c->blocks++;
+  c->bytes += size;
+  return malloc(size);
+}
+
+static void *
+count_memalign(void *ctx, size_t align, size_t size)
+{
+  counter *c = ctx;
+  void *ptr;
+
+  if (posix_memalign(&ptr, align, size) != 0)
+    return NULL;
+
+  c->blocks++;
+  c->bytes += size;
+  return ptr;
+}
+
+static void
+count_free(void *ctx, void *ptr, size_t size)
+{
+  counter *c = ctx;
+  c->blocks--;
+  c->bytes -= size;
+  free(ptr);
+}
+
+int
+main(int argc, const char **argv)
+{
+  counter c = {};
+  scAllocator backend = { count_alloc, count_memalign, NULL, count_free, &c };
+  scAllocator plain = { count_alloc, NULL, NULL, count_free, &c };
+  void *top, *ctx, *tmp, *copy;
+  size_t blocks, bytes;
+  myStruct *a, *b;
+  char *str;
+
+  assert(top = sc_new(NULL, myStruct));
+
+  /* Test that a context and its descendants use the backend */
+  assert(ctx = sc_context_new(top, &backend));
+  assert(!strcmp(sc_tag_get(ctx), "scContext"));
+  assert(c.blocks > 0);
+  assert(a = sc_new(ctx, myStruct));
+  blocks = c.blocks;
+  bytes = c.bytes;
+  assert(b = sc_new(a, myStruct));
+  assert(str = sc_strdup(b, "hello"));
+  assert(c.blocks > 4);
+  assert(sc_tag_set(b, "tag %d", 1));
+
+  /* Test that chunks and edge arrays keep to the backend as they grow */
+  for (int i = 0; i < 100; i++)
+    assert(sc_new(b, char));
+  assert(sc_resizea(&str, 4096));
+  assert(!strcmp(str, "hello"));
+  assert(tmp = sc_memalign(b, 64, 100, NULL));
+  assert(((uintptr_t) tmp) % 64 == 0);
+  assert(tmp = sc_memalign(b, 4096, 100, NULL));
+  assert(((uintptr_t) tmp) % 4096 == 0);
+  assert(sc_resizea((char**) &tmp, 8192));
+  assert(((uintptr_t) tmp) % 4096 == 0);
+
+  /* Test that clones below the context use it too */
+  assert(copy = sc_clone(ctx, a));
+  sc_decref(ctx, a);
+  sc_decref(ctx, copy);
+  assert(c.blocks < blocks);
+  assert(c.bytes < bytes);
+
+  /* Test that chunks linked elsewhere still go back to their backend */
+  assert(a = sc_new(ctx, myStruct));
+  assert(sc_incref(top, a));
+  sc_decref(top, ctx);
+  assert(c.blocks > 0);
+  sc_decref(top, a);
+  assert(c.blocks == 0);
+  assert(c.bytes == 0);
+
+  /* Test that interned strings, which other trees share, avoid backends */
+  assert(ctx = sc_context_new(top, &backend));
+  assert(str = (char*) sc_intern(ctx, "shared"));
+  assert(sc_intern(top, "shared") == str);
+  sc_decref(top, ctx);
+  assert(c.blocks == 0);
+  assert(!strcmp(str, "shared"));
+  sc_decref(top, str);
+
+  /* Test that backends without memalign can't align */
+  assert(ctx = sc_context_new(top, &plain));
+  assert(!sc_memalign(ctx, 64, 100, NULL));
+  assert(a = sc_new(ctx, myStruct));
+  assert(sc_resizea(&a, 10));
+  sc_decref_parallel(top, ctx, 2);
+  assert(c.blocks == 0);
+  assert(c.bytes == 0);
+
+  sc_decref(NULL, top);
+  return 0;
+}
@@ -54,9 +54,38 @@ main(int argc, const char **argv)
   assert(((uintptr_t) tmp) % 4096 == 0);
   assert(sc_size_children(top) == 1);
   assert(sc_size_parents(tmp) == 1);
+
+  /* Check that aligned chunks keep their alignment and edges on resize */
+  assert(sc_new(tmp, myStruct));
+  tmp->a = 42;
+  assert(sc_resizea(&tmp, 1000));
+  assert(((uintptr_t) tmp) % 4096 == 0);
+  assert(tmp->a == 42);
+  assert(sc_size(tmp) == 1000 * sizeof(myStruct));
+  assert(sc_size_children(tmp) == 1);
+  assert(sc_size_parents(tmp) == 1);
   sc_decref(top, tmp);
   assert(sc_size_children(top) == 0);
 
+  /* Check smaller alignments, which keep their header inline */
+  assert(tmp = sc_memalign(top, 64, sizeof(myStruct), NULL));
+  assert(((uintptr_t) tmp) % 64 == 0);
+  tmp->a = 42;
+  assert(sc_resizea(&tmp, 100));
+  assert(((uintptr_t) tmp) % 64 == 0);
+  assert(tmp->a == 42);
+  sc_decref(top, tmp);
+
+  /* Check alignments that the header size is already a multiple of */
+  for (size_t align = 8; align <= 32; align *= 2) {
+    for (int i = 0; i < 100; i++) {
+      assert(tmp = sc_memalign(top, align, sizeof(myStruct), NULL));
+      assert(sc_resizea(&tmp, 1 + i * 10));
+      assert(((uintptr_t) tmp) % align == 0);
+      sc_decref(top, tmp);
+    }
+  }
+
   /* Test incref and decref */
   assert(sc_size_parents(top) == 1);
   sc_incref(NULL, top);
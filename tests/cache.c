@@ -0,0 +1,89 @@
+/*
+ * libsc - Relational memory management
+ *
+ * Copyright 2011 Nathaniel McCallum <nathaniel@themccallums.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+
+static size_t dest = 0;
+
+static void
+destr(void *mem)
+{
+  dest++;
+}
+
+int
+main(int argc, const char **argv)
+{
+  myStruct *a, *b, *c, *d;
+  scCacheStats stats;
+  void *cache;
+
+  /* Test that the entry limit evicts the least recently used entry */
+  assert(cache = sc_cache_new(NULL, 0, 2));
+  assert(a = sc_new(cache, myStruct));
+  assert(b = sc_new(cache, myStruct));
+  sc_destructor_set(a, destr);
+  sc_destructor_set(b, destr);
+  assert(sc_cache_touch(a));
+  assert(c = sc_new(cache, myStruct));
+  sc_destructor_set(c, destr);
+  assert(dest == 1);
+  assert(sc_size_children(cache) == 2);
+  assert(sc_cache_stats(cache, &stats));
+  assert(stats.hits == 1);
+  assert(stats.misses == 3);
+  assert(stats.evictions == 1);
+  assert(stats.entries == 2);
+  assert(stats.bytes == 2 * sizeof(myStruct));
+
+  /* Test that entries with other parents are not evicted */
+  assert(sc_incref(NULL, a));
+  assert(d = sc_new(cache, myStruct));
+  sc_destructor_set(d, destr);
+  assert(dest == 2);
+  assert(sc_cache_stats(cache, &stats));
+  assert(stats.entries == 2);
+  assert(stats.evictions == 2);
+  assert(sc_size_parents(a) == 2);
+
+  /* Test that the byte limit evicts */
+  assert(sc_cache_limits_set(cache, 3 * sizeof(myStruct), 0));
+  assert(b = sc_newa(cache, myStruct, 2));
+  assert(dest == 3);
+  assert(sc_cache_stats(cache, &stats));
+  assert(stats.entries == 2);
+  assert(stats.bytes == 3 * sizeof(myStruct));
+
+  /* Test that growth below an entry evicts other entries */
+  assert(sc_new(a, myStruct));
+  assert(sc_cache_stats(cache, &stats));
+  assert(stats.entries == 1);
+  assert(stats.bytes == 2 * sizeof(myStruct));
+
+  /* Test that releasing entries updates the cache */
+  sc_decref(cache, a);
+  assert(sc_cache_stats(cache, &stats));
+  assert(stats.entries == 0);
+  assert(stats.bytes == 0);
+  assert(!sc_cache_touch(a));
+
+  sc_decref(NULL, cache);
+  sc_decref(NULL, a);
+  return 0;
+}
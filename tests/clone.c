@@ -0,0 +1,125 @@
+/*
+ * libsc - Relational memory management
+ *
+ * Copyright 2011 Nathaniel McCallum <nathaniel@themccallums.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include <string.h>
+
+typedef struct node node;
+struct node {
+  char *name;
+  node *peer;
+};
+
+static size_t dest = 0;
+
+static void
+destr(void *mem)
+{
+  dest++;
+}
+
+static void
+relocate(node *dst, const node *src, void *ctx)
+{
+  dst->name = sc_relocate(ctx, src->name);
+  dst->peer = sc_relocate(ctx, src->peer);
+}
+
+int
+main(int argc, const char **argv)
+{
+  node *top, *a, *b, *copy, *ca, *cb;
+  myStruct *buf;
+
+  assert(sc_relocator_set_type(node, relocate));
+
+  assert(top = sc_new0(NULL, node));
+  assert(a = sc_new0(top, node));
+  assert(b = sc_new0(top, node));
+  assert(sc_incref(a, b));
+  assert(a->name = sc_strdup(a, "a"));
+  assert(sc_tag_set(b, "b%d", 2));
+  assert(buf = sc_memalign0(b, 4096, sizeof(myStruct), NULL));
+  a->peer = b;
+  b->peer = top;
+  sc_destructor_set(b, destr);
+  sc_group(a->name, b);
+
+  /* Test that the copy has the same shape */
+  assert(copy = sc_clone(NULL, top));
+  assert(copy != top);
+  assert(sc_ensure(copy, node));
+  assert(sc_size_parents(copy) == 1);
+  assert(sc_size_children(copy) == 2);
+  assert(sc_size_children_type(copy, node) == 1);
+  assert(sc_size_children_tag(copy, "b2") == 1);
+
+  assert(!copy->peer);
+  sc_decref(NULL, copy);
+  assert(dest == 1);
+
+  /* Test that embedded pointers were relocated */
+  assert(copy = sc_clone(NULL, a));
+  ca = copy;
+  assert(ca != a);
+  assert(!strcmp(ca->name, "a"));
+  assert(ca->name != a->name);
+  assert(cb = ca->peer);
+  assert(cb != b);
+  assert(cb->peer == top);
+  assert(!strcmp(sc_tag_get(cb), "b2"));
+  assert(sc_size_parents(cb) == 1);
+  assert(sc_size_children(ca) == 2);
+  assert(sc_size_children(cb) == 2);
+  assert(sc_size_parents(top) == 1);
+
+  /* Test that the copy can be modified independently */
+  assert(sc_strdup(cb, "more"));
+  assert(sc_size_children(cb) == 3);
+  assert(sc_size_children(b) == 2);
+
+  /* Test that the group was copied along with the destructor */
+  sc_decref(ca, cb);
+  assert(dest == 1);
+  assert(sc_resizea(&ca->name, 16));
+  assert(!strcmp(ca->name, "a"));
+  sc_decref(ca, ca->name);
+  assert(dest == 2);
+  sc_decref(NULL, ca);
+
+  sc_decref(NULL, top);
+  assert(dest == 3);
+
+  /* Test that copies of aligned chunks don't rely on the copies' slab */
+  assert(buf = sc_memalign(NULL, 64, 32, "r"));
+  assert(sc_memalign(buf, 64, 32, "a"));
+  assert(copy = sc_clone(NULL, buf));
+  assert(sc_size_children_tag(copy, "a") == 1);
+  sc_decref(NULL, copy);
+  sc_decref(NULL, buf);
+  assert(a = sc_new0(NULL, node));
+  assert(a->peer = sc_memalign0(a, 64, sizeof(node), NULL));
+  assert(copy = sc_clone(NULL, a));
+  assert(cb = sc_incref(NULL, copy->peer));
+  sc_decref(NULL, copy);
+  assert(sc_size_parents(cb) == 1);
+  sc_decref(NULL, cb);
+  sc_decref(NULL, a);
+  return 0;
+}
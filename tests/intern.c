@@ -0,0 +1,83 @@
+/*
+ * libsc - Relational memory management
+ *
+ * Copyright 2011 Nathaniel McCallum <nathaniel@themccallums.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "common.h"
+
+#include <stdio.h>
+#include <string.h>
+
+int
+main(int argc, const char **argv)
+{
+  const char *a, *b, *c, *strs[1000];
+  char buf[32];
+  void *top, *x, *y;
+  size_t saved;
+
+  assert(top = sc_new(NULL, myStruct));
+  assert(x = sc_new(top, myStruct));
+  assert(y = sc_new(top, myStruct));
+
+  /* Test that identical strings share a chunk */
+  assert(a = sc_intern(x, "content-type"));
+  assert(b = sc_intern(y, "content-type"));
+  assert(c = sc_intern(y, "accept"));
+  assert(a == b);
+  assert(a != c);
+  assert(!strcmp(a, "content-type"));
+  assert(sc_size_parents(a) == 2);
+  assert(sc_intern_saved() > strlen(a));
+  saved = sc_intern_saved();
+
+  /* Test that interned strings are immutable */
+  b = a;
+  assert(!sc_resizea((char**) &b, 64));
+  assert(b == a);
+
+  /* Test that the string survives until the last reference drops */
+  sc_decref(x, a);
+  assert(sc_intern_saved() == 0);
+  assert(!strcmp(a, "content-type"));
+  assert(sc_intern(x, "content-type") == a);
+  assert(sc_intern_saved() == saved);
+  sc_decref(top, x);
+  sc_decref(top, y);
+  assert(sc_intern_saved() == 0);
+
+  /* Test that released entries leave the table intact */
+  for (int i = 0; i < 1000; i++) {
+    snprintf(buf, sizeof(buf), "string %d", i);
+    assert(strs[i] = sc_intern(top, buf));
+  }
+  for (int i = 0; i < 1000; i += 3)
+    sc_decref(top, strs[i]);
+  for (int i = 0; i < 1000; i++) {
+    snprintf(buf, sizeof(buf), "string %d", i);
+    assert(a = sc_intern(top, buf));
+    assert(!strcmp(a, buf));
+    if (i % 3 != 0)
+      assert(a == strs[i]);
+    assert(sc_size_parents(a) == (i % 3 ? 2 : 1));
+  }
+
+  sc_decref(NULL, top);
+  assert(sc_intern_saved() == 0);
+  return 0;
+}
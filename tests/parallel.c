@@ -0,0 +1,132 @@
+/*
+ * libsc - Relational memory management
+ *
+ * Copyright 2011 Nathaniel McCallum <nathaniel@themccallums.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "common.h"
+
+typedef struct node node;
+struct node {
+  node *cousin;
+  int value;
+};
+
+static size_t destroyed;
+
+static void
+destr(node *n)
+{
+  /* A cousin's memory must still be valid while any destructor runs */
+  if (n->cousin)
+    assert(n->cousin->value == 7);
+  __atomic_add_fetch(&destroyed, 1, __ATOMIC_RELAXED);
+}
+
+static size_t
+build(void *parent, node **shared, size_t depth)
+{
+  size_t count = 0;
+  node *n, *c;
+
+  for (int i = 0; i < 4; i++) {
+    assert(n = sc_new(parent, node));
+    assert(c = sc_new(parent, node));
+    n->value = c->value = 7;
+    n->cousin = c;
+    c->cousin = n;
+    sc_group(n, c);
+    sc_destructor_set(n, destr);
+    sc_destructor_set(c, destr);
+    count += 2;
+
+    /* Children reachable from several branches */
+    if (*shared)
+      assert(sc_incref(n, *shared));
+    else {
+      assert(*shared = sc_new(n, node));
+      (*shared)->cousin = NULL;
+      (*shared)->value = 7;
+      sc_destructor_set(*shared, destr);
+      count++;
+    }
+
+    if (depth > 0)
+      count += build(n, shared, depth - 1);
+  }
+
+  return count;
+}
+
+int
+main(int argc, const char **argv)
+{
+  node *shared = NULL;
+  void *top, *keep, *root, *wk;
+  const char *str;
+  size_t count;
+
+  assert(top = sc_new(NULL, myStruct));
+  assert(keep = sc_new(top, myStruct));
+  assert(sc_account(top));
+
+  /* Test that a whole subtree is destroyed exactly once */
+  assert(root = sc_new(top, myStruct));
+  count = build(root, &shared, 5);
+  assert(wk = sc_weak_new(top, shared));
+  sc_decref_parallel(top, root, 4);
+  assert(destroyed == count);
+  assert(sc_weak_get(wk) == NULL);
+  assert(sc_size_retained_chunks(top) == 3);
+
+  /* Test that chunks with surviving parents are kept */
+  destroyed = 0;
+  shared = NULL;
+  assert(root = sc_new(top, myStruct));
+  count = build(root, &shared, 3);
+  assert(sc_incref(keep, shared));
+  sc_decref_parallel(top, root, 0);
+  assert(destroyed == count - 1);
+  assert(sc_size_parents(shared) == 1);
+  assert(sc_size_retained_chunks(top) == 4);
+
+  /* Test that a single thread falls back to a serial teardown */
+  destroyed = 0;
+  sc_decref_parallel(keep, shared, 1);
+  assert(destroyed == 1);
+
+  /* Test that out-of-line chunks are freed without the global lock */
+  assert(root = sc_new(top, myStruct));
+  for (count = 0; count < 64; count++)
+    assert(sc_memalign(root, 4096, 100, NULL));
+  sc_decref_parallel(top, root, 4);
+  assert(root = sc_memalign(top, 4096, 100, NULL));
+  assert(sc_size(root) == 100);
+  sc_decref(top, root);
+
+  /* Test that a dropped interned string leaves the table */
+  assert(str = sc_intern(top, "parallel"));
+  sc_decref_parallel(top, (char*) str, 4);
+  assert(sc_intern_saved() == 0);
+  assert(str = sc_intern(top, "parallel"));
+  assert(sc_intern(keep, "parallel") == str);
+  sc_decref_parallel(top, (char*) str, 4);
+  assert(sc_intern(keep, "parallel") == str);
+  assert(sc_size_parents((char*) str) == 2);
+  sc_decref(NULL, top);
+  return 0;
+}
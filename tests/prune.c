@@ -0,0 +1,122 @@
+/*
+ * libsc - Relational memory management
+ *
+ * Copyright 2011 Nathaniel McCallum <nathaniel@themccallums.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "common.h"
+
+static size_t freed = 0;
+
+static void
+destr(void *mem)
+{
+  freed++;
+}
+
+static bool
+odd(void *child, void *arg)
+{
+  (*(size_t*) arg)++;
+  return ((myStruct*) child)->a % 2 == 1;
+}
+
+int
+main(int argc, const char **argv)
+{
+  myStruct *top, *other, *kids[1000], *a, *b;
+  void *drop[1000];
+  size_t calls = 0;
+
+  assert(top = sc_new(NULL, myStruct));
+  assert(other = sc_new0(top, myStruct));
+  for (int i = 0; i < 1000; i++) {
+    assert(kids[i] = sc_new(top, myStruct));
+    kids[i]->a = i;
+    sc_destructor_set(kids[i], destr);
+    if (i % 10 == 0)
+      assert(sc_tag_set_const(kids[i], "tenth"));
+  }
+  assert(sc_size_children(top) == 1001);
+
+  /* Test dropping every other child in one call */
+  for (int i = 0; i < 500; i++)
+    drop[i] = kids[i * 2];
+  sc_decref_many(top, drop, 500);
+  assert(freed == 500);
+  assert(sc_size_children(top) == 501);
+  assert(sc_size_children_tag(top, "tenth") == 0);
+  for (int i = 1; i < 1000; i += 2)
+    assert(sc_size_parents(kids[i]) == 1);
+
+  /* Test that references held elsewhere, duplicates and strays are kept */
+  assert(sc_incref(other, kids[1]));
+  assert(sc_incref(top, kids[3]));
+  drop[0] = kids[1];
+  drop[1] = kids[3];
+  drop[2] = NULL;
+  assert(drop[3] = sc_new(other, myStruct));
+  sc_decref_many(top, drop, 4);
+  assert(freed == 500);
+  assert(sc_size_parents(kids[1]) == 1);
+  assert(sc_size_parents(kids[3]) == 1);
+  assert(sc_size_children(top) == 500);
+  sc_decref_many(other, drop, 1);
+  sc_decref_many(top, drop + 1, 1);
+  assert(freed == 502);
+  assert(sc_size_children(other) == 1);
+
+  /* Test that duplicates drop one edge each */
+  assert(sc_incref(top, kids[5]));
+  drop[0] = drop[1] = kids[5];
+  sc_decref_many(top, drop, 2);
+  assert(freed == 503);
+
+  /* Test that a group dies only with its last parent edge */
+  assert(a = sc_new(top, myStruct));
+  assert(b = sc_new(top, myStruct));
+  sc_destructor_set(a, destr);
+  sc_destructor_set(b, destr);
+  sc_group(a, b);
+  drop[0] = a;
+  sc_decref_many(top, drop, 1);
+  assert(freed == 503);
+  drop[0] = b;
+  drop[1] = kids[7];
+  sc_decref_many(top, drop, 2);
+  assert(freed == 506);
+
+  /* Test pruning by predicate */
+  for (int i = 9; i < 1000; i += 2)
+    kids[i]->a = i % 4 == 1;
+  calls = 0;
+  sc_prune(top, odd, &calls);
+  assert(calls == sc_size_children(top) + 248);
+  assert(freed == 754);
+  for (int i = 11; i < 1000; i += 4)
+    assert(sc_size_parents(kids[i]) == 1);
+
+  /* Test dropping top level chunks */
+  assert(a = sc_new(NULL, myStruct));
+  sc_destructor_set(a, destr);
+  drop[0] = a;
+  drop[1] = top;
+  sc_decref_many(NULL, drop, 2);
+  assert(freed == 1003);
+
+  return 0;
+}
@@ -0,0 +1,101 @@
+/*
+ * libsc - Relational memory management
+ *
+ * Copyright 2011 Nathaniel McCallum <nathaniel@themccallums.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+static char name[64];
+
+static void
+publish(const char *value)
+{
+  myStruct *top;
+
+  assert(top = sc_new0(NULL, myStruct));
+  assert(sc_strdup(top, value));
+  assert(sc_tag_set(top, "%s", value));
+  assert(sc_shm_publish(top, name));
+  sc_decref(NULL, top);
+}
+
+static int
+reader(int rd, int wr)
+{
+  void *snap, *root;
+  char c;
+
+  /* Map the first version and let the writer know */
+  assert(snap = sc_shm_map(NULL, name));
+  assert(root = sc_snapshot_root(snap));
+  assert(!strcmp(sc_tag_get(root), "one"));
+  assert(sc_size_children_type(root, char) == 2);
+  assert(sc_shm_current(snap));
+  assert(write(wr, "m", 1) == 1);
+
+  /* Our mapping survives the publication of a new version */
+  assert(read(rd, &c, 1) == 1);
+  assert(!sc_shm_current(snap));
+  assert(!strcmp(sc_tag_get(root), "one"));
+  sc_decref(NULL, snap);
+
+  assert(snap = sc_shm_map(NULL, name));
+  assert(root = sc_snapshot_root(snap));
+  assert(!strcmp(sc_tag_get(root), "two"));
+  assert(sc_size(root) == sizeof(myStruct));
+  assert(sc_shm_current(snap));
+  sc_decref(NULL, snap);
+  return 0;
+}
+
+int
+main(int argc, const char **argv)
+{
+  int down[2], up[2], status;
+  pid_t pid;
+  char c;
+
+  snprintf(name, sizeof(name), "/libsc-test-%d", (int) getpid());
+  assert(!sc_shm_map(NULL, name));
+  publish("one");
+
+  assert(pipe(down) == 0);
+  assert(pipe(up) == 0);
+  pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    close(down[1]);
+    close(up[0]);
+    _exit(reader(down[0], up[1]));
+  }
+
+  close(down[0]);
+  close(up[1]);
+  assert(read(up[0], &c, 1) == 1);
+  publish("two");
+  assert(write(down[1], "p", 1) == 1);
+
+  assert(waitpid(pid, &status, 0) == pid);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  assert(sc_shm_remove(name));
+  assert(!sc_shm_map(NULL, name));
+  return 0;
+}
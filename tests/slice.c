@@ -0,0 +1,109 @@
+/*
+ * libsc - Relational memory management
+ *
+ * Copyright 2011 Nathaniel McCallum <nathaniel@themccallums.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "common.h"
+
+#include <string.h>
+
+int
+main(int argc, const char **argv)
+{
+  scSlice *a, *b, *c;
+  char *buf, *str;
+  void *top;
+
+  assert(top = sc_new(NULL, myStruct));
+  assert(buf = sc_strdup(top, "Hello, World!"));
+
+  /* Test that slices view the buffer without copying */
+  assert(a = sc_slice(top, buf, 7, 5));
+  assert(a->data == buf + 7);
+  assert(a->len == 5);
+  assert(sc_size_parents(buf) == 2);
+  assert(!sc_slice(top, buf, 10, 5));
+  assert(!sc_slice(top, buf, 15, 0));
+
+  /* Test that a slice of a slice refers to the buffer */
+  assert(b = sc_slice(top, a, 1, 3));
+  assert(b->data == buf + 8);
+  assert(sc_size_parents(a) == 1);
+  assert(sc_size_parents(buf) == 3);
+
+  /* Test materializing a terminated string */
+  assert(str = sc_slice_strdup(top, b));
+  assert(!strcmp(str, "orl"));
+  sc_decref(top, str);
+
+  /* Test that slices keep the buffer alive */
+  sc_decref(top, buf);
+  assert(!memcmp(a->data, "World", 5));
+
+  /* Test that slices follow a buffer that moves or shrinks */
+  buf = (char*) a->data - 7;
+  assert(sc_resizea(&buf, 4096));
+  assert(a->data == buf + 7);
+  assert(b->data == buf + 8);
+  assert(!memcmp(a->data, "World", 5));
+  assert(sc_resizea(&buf, 9));
+  assert(a->len == 2);
+  assert(b->len == 1);
+  assert(sc_resizea(&buf, 4));
+  assert(a->len == 0);
+
+  /* Test that the buffer is freed with the last slice */
+  sc_decref(top, a);
+  assert(sc_size_parents(buf) == 1);
+  sc_decref(top, b);
+
+  /* Test that clones of slices view the cloned buffer */
+  assert(buf = sc_strdup(top, "Hello, World!"));
+  assert(a = sc_slice(top, buf, 7, 5));
+  sc_decref(top, buf);
+  assert(c = sc_clone(top, a));
+  assert(c->data != a->data);
+  assert(!memcmp(c->data, "World", 5));
+  sc_decref(top, a);
+  assert(!memcmp(c->data, "World", 5));
+  assert(sc_slice_strdup(top, c));
+  sc_decref(NULL, top);
+
+  /* Test that chunks without a parent can still be resized */
+  assert(buf = sc_newa(NULL, char, 100));
+  assert(sc_resizea(&buf, 10));
+  assert(sc_resizea(&buf, 100000));
+  sc_decref(NULL, buf);
+  assert(buf = sc_memalign(NULL, 4096, 100, NULL));
+  assert(sc_resizea(&buf, 100000));
+  assert(((uintptr_t) buf) % 4096 == 0);
+  assert(sc_resizea(&buf, 10));
+  sc_decref(NULL, buf);
+
+  /* Test that a slice keeps an interned string in the table */
+  assert(top = sc_new(NULL, myStruct));
+  assert(str = (char*) sc_intern(top, "Hello, World!"));
+  assert(a = sc_slice(top, str, 0, 5));
+  sc_decref(top, str);
+  assert(sc_intern(top, "Hello, World!") == str);
+  sc_decref(top, str);
+  sc_decref(top, a);
+  assert(sc_intern_saved() == 0);
+  sc_decref(NULL, top);
+  return 0;
+}
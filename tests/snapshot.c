@@ -0,0 +1,126 @@
+/*
+ * libsc - Relational memory management
+ *
+ * Copyright 2011 Nathaniel McCallum <nathaniel@themccallums.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+typedef struct node node;
+struct node {
+  const char *name;
+  node *next;
+};
+
+static void
+relocate(node *dst, const node *src, void *ctx)
+{
+  dst->name = sc_relocate(ctx, src->name);
+  dst->next = sc_relocate(ctx, src->next);
+}
+
+int
+main(int argc, const char **argv)
+{
+  char path[] = "snapshot.XXXXXX";
+  node *top, *a, *b, *root;
+  void *snap;
+  FILE *file;
+  int fd;
+
+  assert((fd = mkstemp(path)) >= 0);
+  close(fd);
+
+  assert(sc_relocator_set_type(node, relocate));
+
+  /* Build a small tree with a shared chunk and embedded pointers */
+  assert(top = sc_new0(NULL, node));
+  assert(a = sc_new0(top, node));
+  assert(b = sc_new0(top, node));
+  assert(sc_incref(a, b));
+  assert(top->name = sc_strdup(top, "top"));
+  assert(a->name = sc_strdup(a, "a"));
+  assert(sc_tag_set(b, "leaf %d", 1));
+  top->next = a;
+  a->next = b;
+  assert(sc_size_children(top) == 3);
+
+  assert(sc_snapshot_write(top, path));
+  sc_decref(NULL, top);
+
+  /* Map the snapshot back and inspect it */
+  assert(snap = sc_snapshot_map(NULL, path));
+  assert(root = sc_snapshot_root(snap));
+  assert(sc_ensure(root, node));
+  assert(sc_size(root) == sizeof(node));
+  assert(sc_size_parents(root) == 0);
+  assert(sc_size_children(root) == 3);
+  assert(sc_size_children_type(root, node) == 1);
+  assert(sc_size_children_type(root, char) == 1);
+  assert(sc_size_children_tag(root, "leaf 1") == 1);
+  assert(!strcmp(sc_snapshot_ptr(root, root->name), "top"));
+
+  a = sc_snapshot_ptr(root, root->next);
+  assert(sc_ensure(a, node));
+  assert(!strcmp(sc_snapshot_ptr(a, a->name), "a"));
+  assert(sc_size_parents(a) == 1);
+  assert(sc_size_children(a) == 2);
+
+  b = sc_snapshot_ptr(a, a->next);
+  assert(!strcmp(sc_tag_get(b), "leaf 1"));
+  assert(sc_size_parents(b) == 2);
+  assert(sc_size_parents_type(b, node) == 2);
+  assert(!sc_snapshot_ptr(b, b->next));
+
+  /* The mapped hierarchy is read-only */
+  assert(!sc_new(root, node));
+  assert(!sc_incref(NULL, root));
+  assert(!sc_resizea(&a, 2));
+  assert(!sc_tag_set_const(a, "foo"));
+  sc_decref(root, a);
+  assert(sc_size_children(root) == 3);
+  sc_decref(NULL, snap);
+
+  /* Test that a copy keeps its tag after leaving the copied slab */
+  assert(a = sc_new0(NULL, node));
+  assert(sc_tag_set_const(a, "single"));
+  assert(sc_snapshot_write(a, path));
+  sc_decref(NULL, a);
+  assert(snap = sc_snapshot_map(NULL, path));
+  assert(a = sc_clone(NULL, sc_snapshot_root(snap)));
+  sc_decref(NULL, snap);
+  assert(sc_resizea(&a, 100));
+  assert(!strcmp(sc_tag_get(a), "single"));
+
+  /* Test that an image with a valid header but damaged chunks is refused */
+  assert(sc_snapshot_write(a, path));
+  sc_decref(NULL, a);
+  assert(file = fopen(path, "r+"));
+  assert(fseek(file, 64, SEEK_SET) == 0);
+  for (fd = 0; fd < 32; fd++)
+    assert(fputc(0x7f, file) != EOF);
+  assert(fclose(file) == 0);
+  errno = 0;
+  assert(!sc_snapshot_map(NULL, path));
+  assert(errno == EINVAL);
+
+  unlink(path);
+  return 0;
+}
@@ -32,6 +32,25 @@ main(int argc, const char **argv)
   assert(!strcmp(sc_tag_get(top), "foo"));
   assert(sc_tag_set(top, "foo %s", "bar"));
   assert(!strcmp(sc_tag_get(top), "foo bar"));
+
+  /* Test counting tags across a wide parent */
+  for (int i = 0; i < 100; i++) {
+    assert(tmp = sc_new(top, myStruct));
+    if (i % 3 == 0)
+      assert(sc_tag_set(tmp, "item"));
+  }
+  assert(sc_size_children_type(top, myStruct) == 66);
+  assert(sc_size_children_tag(top, "item") == 34);
+  assert(sc_size_children_tag(top, "char") == 1);
+  assert(sc_size_children_tag(top, "none") == 0);
+  assert(sc_size_parents_tag(tmp, "foo bar") == 1);
+
+  /* Test that retagging and removing children keep the counts right */
+  assert(sc_tag_set_const(tmp, "myStruct"));
+  assert(sc_size_children_type(top, myStruct) == 67);
+  assert(sc_size_children_tag(top, "item") == 33);
+  sc_decref(top, tmp);
+  assert(sc_size_children_type(top, myStruct) == 66);
   sc_decref(NULL, top);
 
   return 0;
@@ -0,0 +1,75 @@
+/*
+ * libsc - Relational memory management
+ *
+ * Copyright 2011 Nathaniel McCallum <nathaniel@themccallums.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+
+static void *seen = (void*) 1;
+static void *handle = NULL;
+
+static void
+destr(void *mem)
+{
+  seen = sc_weak_get(handle);
+}
+
+int
+main(int argc, const char **argv)
+{
+  myStruct *top, *tmp;
+  void *a, *b;
+
+  assert(top = sc_new(NULL, myStruct));
+  assert(tmp = sc_new(top, myStruct));
+
+  /* Test that weak handles don't hold references */
+  assert(a = sc_weak_new(top, tmp));
+  assert(b = sc_weak_new(NULL, tmp));
+  assert(sc_size_parents(tmp) == 1);
+  assert(sc_weak_get(a) == tmp);
+  assert(sc_weak_get(b) == tmp);
+
+  /* Test that handles survive resizing */
+  assert(sc_resizea(&tmp, 64));
+  assert(sc_weak_get(a) == tmp);
+  assert(sc_weak_get(b) == tmp);
+
+  /* Test releasing one handle leaves the other intact */
+  sc_decref(top, a);
+  assert(sc_weak_get(b) == tmp);
+
+  /* Test that handles are cleared before destructors run */
+  handle = b;
+  sc_destructor_set(tmp, destr);
+  sc_decref(top, tmp);
+  assert(seen == NULL);
+  assert(sc_weak_get(b) == NULL);
+  sc_decref(NULL, b);
+
+  /* Test that a handle can be released along with its target */
+  assert(tmp = sc_new(top, myStruct));
+  assert(a = sc_weak_new(tmp, tmp));
+  assert(sc_weak_get(a) == tmp);
+  assert(sc_size_parents(tmp) == 1);
+
+  /* Test that handles can't be moved away from their list */
+  assert(!sc_resizea((char**) &a, 4096));
+  assert(sc_weak_get(a) == tmp);
+  sc_decref(NULL, top);
+  return 0;
+}